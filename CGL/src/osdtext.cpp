@@ -25,6 +25,8 @@ OSDText::OSDText() {
 
   ft   = new FT_Library;
   face = new FT_Face;
+  font = NULL;
+  program = 0;
 
   lines = vector<OSDLine>(); next_id = 0;
 }
@@ -37,7 +39,8 @@ OSDText::~OSDText() {
 
   lines.clear();
 
-  glDeleteProgram(program);
+  // Windowless applications never init(), so there is no GL context.
+  if (program) glDeleteProgram(program);
 }
 
 int OSDText::init(bool use_hdpi) {
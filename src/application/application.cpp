@@ -20,6 +20,8 @@ namespace CGL {
 
 Application::Application(AppConfig config, bool gl) {
   gl_window = gl;
+  debugger = NULL;
+  scene = nullptr;
   renderer = new RaytracedRenderer (
     config.pathtracer_ns_aa,
     config.pathtracer_max_ray_depth,
@@ -34,8 +36,26 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_direct_hemisphere_sample,
     config.pathtracer_filename,
     config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
+    config.pathtracer_focalDistance,
+    config.pathtracer_samples_per_pass,
+    config.pathtracer_time_budget,
+    config.pathtracer_denoise,
+    config.pathtracer_path_guiding,
+    config.pathtracer_irradiance_cache_error,
+    config.pathtracer_caustic_photons,
+    config.pathtracer_bidirectional,
+    config.pathtracer_sample_sequence,
+    config.pathtracer_seed,
+    config.pathtracer_worker_processes,
+    config.pathtracer_checkpoint_file,
+    config.pathtracer_checkpoint_interval,
+    config.pathtracer_interactive,
+    config.pathtracer_stream_exr,
+    config.pathtracer_aov_passes,
+    config.pathtracer_scene_file,
+    config.pathtracer_thread_pool
   );
+  interactiveRender = config.pathtracer_interactive;
   filename = config.pathtracer_filename;
 }
 
@@ -65,6 +85,7 @@ void Application::init() {
     leftDown   = false;
     rightDown  = false;
     middleDown = false;
+    cameraDragged = false;
 
     show_coordinates = true;
     show_hud = true;
@@ -386,6 +407,11 @@ void Application::scroll_event(float offset_x, float offset_y) {
       camera.move_forward(-offset_y * scroll_rate);
       break;
     case RENDER_MODE:
+      if (interactiveRender && !renderer->render_cell) {
+        renderer->stop();
+        camera.move_forward(-offset_y * scroll_rate);
+        renderer->camera_moved();
+      }
       break;
   }
 }
@@ -451,6 +477,7 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
             renderer->start_raytracing();
             break;
           case 'C': 
+          case 'x': case 'X':
             renderer->key_press(key);
             break;
           case 'r': case 'R':
@@ -542,9 +569,11 @@ void Application::mouse_pressed(e_mouse_button b) {
         renderer->cell_br = renderer->cell_tl;
       }
       leftDown = true;
+      cameraDragged = false;
       break;
     case RIGHT:
       rightDown = true;
+      cameraDragged = false;
       break;
     case MIDDLE:
       middleDown = true;
@@ -569,7 +598,7 @@ void Application::mouse_released(e_mouse_button b) {
       }
       break;
     case RIGHT:
-      if (mode == RENDER_MODE) {
+      if (mode == RENDER_MODE && !cameraDragged) {
         renderer->autofocus(Vector2D(mouseX, screenH - mouseY));
         renderer->stop();
         renderer->start_raytracing();
@@ -587,12 +616,20 @@ void Application::mouse_released(e_mouse_button b) {
   When in visualization mode, rotate.
 */
 void Application::mouse1_dragged(float x, float y) {
+  float dx = (x - mouseX);
+  float dy = (y - mouseY);
+
   if (mode == RENDER_MODE) {
-    renderer->cell_br = Vector2D(x, screenH - y);
+    if (interactiveRender && !renderer->render_cell) {
+      renderer->stop();
+      camera.rotate_by(-dy * (PI / screenH), -dx * (PI / screenW));
+      renderer->camera_moved();
+      cameraDragged = true;
+    } else {
+      renderer->cell_br = Vector2D(x, screenH - y);
+    }
     return;
   }
-  float dx = (x - mouseX);
-  float dy = (y - mouseY);
 
   if (mode == EDIT_MODE && scene->has_selection()) {
     scene->drag_selection(2 * dx / screenW, 2 * -dy / screenH,
@@ -606,10 +643,19 @@ void Application::mouse1_dragged(float x, float y) {
   When the mouse is dragged with the right button held down, translate.
 */
 void Application::mouse2_dragged(float x, float y) {
-  if (mode == RENDER_MODE) return;
   float dx = (x - mouseX);
   float dy = (y - mouseY);
 
+  if (mode == RENDER_MODE) {
+    if (interactiveRender && !renderer->render_cell) {
+      renderer->stop();
+      camera.move_by(-dx, dy, canonical_view_distance);
+      renderer->camera_moved();
+      cameraDragged = true;
+    }
+    return;
+  }
+
   // don't negate y because up is down.
   camera.move_by(-dx, dy, canonical_view_distance);
 }
@@ -57,9 +57,26 @@ struct AppConfig {
 
     pathtracer_samples_per_patch = 32;
     pathtracer_max_tolerance = 0.05f;
+    pathtracer_samples_per_pass = 0;
+    pathtracer_time_budget = 0.0;
+    pathtracer_denoise = false;
+    pathtracer_path_guiding = false;
+    pathtracer_irradiance_cache_error = 0.0;
+    pathtracer_caustic_photons = 0;
+    pathtracer_bidirectional = false;
+    pathtracer_sample_sequence = SEQUENCE_RANDOM;
+    pathtracer_seed = -1;
+    pathtracer_worker_processes = 0;
+    pathtracer_checkpoint_file = "";
+    pathtracer_checkpoint_interval = 60;
+    pathtracer_interactive = false;
+    pathtracer_stream_exr = false;
+    pathtracer_aov_passes = 0;
     pathtracer_direct_hemisphere_sample = false;
 
     pathtracer_filename = "";
+    pathtracer_scene_file = "";
+    pathtracer_thread_pool = nullptr;
     pathtracer_lensRadius = 0.0;
     pathtracer_focalDistance = 4.7;
   }
@@ -78,9 +95,27 @@ struct AppConfig {
   float pathtracer_max_tolerance;
   size_t pathtracer_samples_per_patch;
 
+  size_t pathtracer_samples_per_pass;
+  double pathtracer_time_budget;
+  bool pathtracer_denoise;
+  bool pathtracer_path_guiding;
+  double pathtracer_irradiance_cache_error;
+  size_t pathtracer_caustic_photons;
+  bool pathtracer_bidirectional;
+  SampleSequence pathtracer_sample_sequence;
+  long long pathtracer_seed;
+  size_t pathtracer_worker_processes;
+  string pathtracer_checkpoint_file;
+  double pathtracer_checkpoint_interval;
+  bool pathtracer_interactive;
+  bool pathtracer_stream_exr;
+  int pathtracer_aov_passes;
+
   bool pathtracer_direct_hemisphere_sample;
 
   string pathtracer_filename;
+  string pathtracer_scene_file;
+  std::shared_ptr<ThreadPool> pathtracer_thread_pool;
 
   double pathtracer_lensRadius;
   double pathtracer_focalDistance;
@@ -111,10 +146,27 @@ class Application : public Renderer {
     renderer->render_to_file(filename, x, y, dx, dy); 
   }
 
+  std::vector<std::pair<std::string, std::string>> render_to_png(
+      std::vector<unsigned char>& png, size_t x, size_t y, size_t dx, size_t dy) {
+    set_up_pathtracer();
+    return renderer->render_to_png(png, x, y, dx, dy);
+  }
+
+  void set_samples_per_pixel(size_t ns_aa) {
+    renderer->set_samples_per_pixel(ns_aa);
+  }
+
+  void wait_for_writes() {
+    renderer->wait_for_writes();
+  }
+
   void load_camera(std::string filename) {
     camera.load_settings(filename);
   }
 
+  // Resets the camera to the canonical initial view position.
+  void reset_camera();
+
   enum Mode {
     EDIT_MODE,
     RENDER_MODE,
@@ -178,9 +230,6 @@ private:
 
   void set_scroll_rate();
 
-  // Resets the camera to the canonical initial view position.
-  void reset_camera();
-
   // Rendering functions.
   void update_gl_camera();
 
@@ -201,6 +250,7 @@ private:
   bool leftDown;
   bool rightDown;
   bool middleDown;
+  bool cameraDragged;  ///< the camera of an interactive render moved since the last press
 
   // Event handling //
 
@@ -226,6 +276,7 @@ private:
     string str, size_t size, const Color& c);
 
   bool gl_window;
+  bool interactiveRender;  ///< the mouse moves the camera of a render in progress
 
   std::string filename;
 
@@ -5,15 +5,19 @@
 #include "CGL/tinyexr.h"
 
 #include "application.h"
+#include "render_daemon.h"
 typedef uint32_t gid_t;
 #include "util/image.h"
 typedef uint32_t gid_t;
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #ifdef _WIN32
 #include "util/win32/getopt.h"
 #else
 #include <unistd.h>
+#include <getopt.h>
 #endif
 
 using namespace std;
@@ -33,6 +37,23 @@ void usage(const char* binaryName) {
   printf("  -d  <FLOAT>      The focal distance\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
+  printf("  -P  <INT>        Render progressively, this many samples per pixel per pass\n");
+  printf("  --time-budget <FLOAT>  Render adaptively until this many seconds have passed\n");
+  printf("  --denoise        Denoise the finished render using first-hit albedo, normal and depth\n");
+  printf("  --guide          Guide bounces by incident radiance learned while rendering\n");
+  printf("  --irradiance-cache <FLOAT>  Interpolate diffuse indirect light from a cache with this error threshold\n");
+  printf("  --caustics <INT>  Gather caustics from this many photons traced through mirrors and glass\n");
+  printf("  --bdpt           Render with bidirectional path tracing\n");
+  printf("  --split <INT> <INT> <INT>  Bounces traced from the first diffuse, glossy and glass hit of a camera ray\n");
+  printf("  --sampler <NAME>  Sequence pixel samples draw from: random, sobol, halton or bluenoise\n");
+  printf("  --seed <INT>     Render reproducibly from this seed, whatever the number of threads\n");
+  printf("  --workers <INT>  Spread a windowless render over this many worker processes\n");
+  printf("  --batch <FILE>   Render every job listed in the file, loading the scene once\n");
+  printf("  --daemon <PATH>  Serve render requests on a Unix socket, keeping scenes loaded\n");
+  printf("  --checkpoint <FILE> <FLOAT>  Save the render to the file this often (seconds), and resume from it\n");
+  printf("  --stream         Render the -f file as a tiled EXR, a band of rows at a time\n");
+  printf("  --interactive    Preview the render coarse first, and let the mouse move its camera\n");
+  printf("  --aov <LIST>     Also save these passes, with the linear image, to an EXR: depth, normal, albedo, id, samples or all\n");
   printf("  -h               Print this help message\n");
   printf("\n");
 }
@@ -76,14 +97,132 @@ HDRImageBuffer* load_exr(const char* file_path) {
   return envmap;
 }
 
+/**
+ * Render the jobs of a batch file one after the other with the scene loaded
+ * once. Each line is an output file, a width and height (0 0 for those of
+ * -r), and optionally a camera settings file; jobs without one keep the
+ * camera of the job before, starting from the -c or scene camera. Empty
+ * lines and lines starting with # are skipped.
+ */
+int render_batch(Application* app, const string& batch_file, size_t w, size_t h,
+                 const string& cam_settings) {
+  ifstream file(batch_file);
+  if (!file) {
+    msg("Could not open batch file " << batch_file);
+    return 1;
+  }
+
+  struct Job { string output; size_t w, h; string camera; };
+  vector<Job> jobs;
+  string line;
+  for (int number = 1; getline(file, line); number++) {
+    istringstream fields(line);
+    Job job;
+    if (!(fields >> job.output) || job.output[0] == '#') continue;
+    if (!(fields >> job.w >> job.h)) {
+      msg("Batch file " << batch_file << ":" << number << ": expected <output> <width> <height> [<camera file>]");
+      return 1;
+    }
+    fields >> job.camera;
+    if (job.w == 0 || job.h == 0) { job.w = w; job.h = h; }
+    jobs.push_back(job);
+  }
+
+  if (cam_settings != "")
+    app->load_camera(cam_settings);
+
+  Timer timer;
+  timer.start();
+  for (size_t i = 0; i < jobs.size(); i++) {
+    const Job& job = jobs[i];
+    msg("Batch job " << i + 1 << " of " << jobs.size() << ": " << job.output);
+    if (job.w && job.h)
+      app->resize(job.w, job.h);
+    if (job.camera != "")
+      app->load_camera(job.camera);
+    app->render_to_file(job.output, -1, 0, 0, 0);
+  }
+  app->wait_for_writes();
+  timer.stop();
+  msg("Rendered " << jobs.size() << " batch jobs in " << timer.duration() << " sec");
+  return 0;
+}
+
+// Parse a comma-separated list of AOV pass names into AOVPass flags, or -1.
+int parse_aov_passes(const string& list) {
+  int passes = 0;
+  stringstream ss(list);
+  string name;
+  while (getline(ss, name, ',')) {
+    if (name == "depth") {
+      passes |= AOV_DEPTH;
+    } else if (name == "normal") {
+      passes |= AOV_NORMAL;
+    } else if (name == "albedo") {
+      passes |= AOV_ALBEDO;
+    } else if (name == "id") {
+      passes |= AOV_ID;
+    } else if (name == "samples") {
+      passes |= AOV_SAMPLES;
+    } else if (name == "all") {
+      passes |= AOV_ALL;
+    } else {
+      msg("Unknown AOV pass " << name);
+      return -1;
+    }
+  }
+  return passes;
+}
+
+// Long-only options get values past the range of short option characters.
+enum {
+  OPT_TIME_BUDGET = 256,
+  OPT_DENOISE,
+  OPT_GUIDE,
+  OPT_IRRADIANCE_CACHE,
+  OPT_CAUSTICS,
+  OPT_BDPT,
+  OPT_SPLIT,
+  OPT_SAMPLER,
+  OPT_SEED,
+  OPT_WORKERS,
+  OPT_BATCH,
+  OPT_DAEMON,
+  OPT_CHECKPOINT,
+  OPT_INTERACTIVE,
+  OPT_STREAM,
+  OPT_AOV
+};
+
+static const struct option long_options[] = {
+  {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+  {"denoise", no_argument, NULL, OPT_DENOISE},
+  {"guide", no_argument, NULL, OPT_GUIDE},
+  {"irradiance-cache", required_argument, NULL, OPT_IRRADIANCE_CACHE},
+  {"caustics", required_argument, NULL, OPT_CAUSTICS},
+  {"bdpt", no_argument, NULL, OPT_BDPT},
+  {"split", required_argument, NULL, OPT_SPLIT},
+  {"sampler", required_argument, NULL, OPT_SAMPLER},
+  {"seed", required_argument, NULL, OPT_SEED},
+  {"workers", required_argument, NULL, OPT_WORKERS},
+  {"batch", required_argument, NULL, OPT_BATCH},
+  {"daemon", required_argument, NULL, OPT_DAEMON},
+  {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+  {"interactive", no_argument, NULL, OPT_INTERACTIVE},
+  {"stream", no_argument, NULL, OPT_STREAM},
+  {"aov", required_argument, NULL, OPT_AOV},
+  {NULL, 0, NULL, 0}
+};
+
 int main( int argc, char** argv ) {
 
   // get the options
   AppConfig config; int opt;
   bool write_to_file = false;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
-  string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:")) != -1 ) {  // for each option...
+  string filename, cam_settings = "", batch_file = "", daemon_socket = "";
+  while ( (opt = getopt_long(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:P:",
+                              long_options, NULL)) != -1 ) {  // for each option...
     switch ( opt ) {
     case 'f':
       write_to_file = true;
@@ -131,6 +270,78 @@ int main( int argc, char** argv ) {
       config.pathtracer_max_tolerance = atof(argv[optind]);
       optind++;
       break;
+    case 'P':
+      config.pathtracer_samples_per_pass = atoi(optarg);
+      break;
+    case OPT_TIME_BUDGET:
+      config.pathtracer_time_budget = atof(optarg);
+      break;
+    case OPT_DENOISE:
+      config.pathtracer_denoise = true;
+      break;
+    case OPT_GUIDE:
+      config.pathtracer_path_guiding = true;
+      break;
+    case OPT_IRRADIANCE_CACHE:
+      config.pathtracer_irradiance_cache_error = atof(optarg);
+      break;
+    case OPT_CAUSTICS:
+      config.pathtracer_caustic_photons = atoi(optarg);
+      break;
+    case OPT_BDPT:
+      config.pathtracer_bidirectional = true;
+      break;
+    case OPT_SPLIT:
+      config.pathtracer_ns_diff = atoi(optarg);
+      config.pathtracer_ns_glsy = atoi(argv[optind]);
+      config.pathtracer_ns_refr = atoi(argv[optind+1]);
+      optind += 2;
+      break;
+    case OPT_SAMPLER:
+      if (string(optarg) == "random") {
+        config.pathtracer_sample_sequence = SEQUENCE_RANDOM;
+      } else if (string(optarg) == "sobol") {
+        config.pathtracer_sample_sequence = SEQUENCE_SOBOL;
+      } else if (string(optarg) == "halton") {
+        config.pathtracer_sample_sequence = SEQUENCE_HALTON;
+      } else if (string(optarg) == "bluenoise") {
+        config.pathtracer_sample_sequence = SEQUENCE_BLUE_NOISE;
+      } else {
+        msg("Unknown sampler " << optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_SEED:
+      config.pathtracer_seed = strtoul(optarg, NULL, 10) & 0xffffffff;
+      break;
+    case OPT_WORKERS:
+      config.pathtracer_worker_processes = atoi(optarg);
+      break;
+    case OPT_BATCH:
+      batch_file = string(optarg);
+      break;
+    case OPT_DAEMON:
+      daemon_socket = string(optarg);
+      break;
+    case OPT_CHECKPOINT:
+      config.pathtracer_checkpoint_file = string(optarg);
+      config.pathtracer_checkpoint_interval = atof(argv[optind]);
+      optind++;
+      break;
+    case OPT_INTERACTIVE:
+      config.pathtracer_interactive = true;
+      break;
+    case OPT_STREAM:
+      config.pathtracer_stream_exr = true;
+      break;
+    case OPT_AOV:
+      config.pathtracer_aov_passes = parse_aov_passes(optarg);
+      if (config.pathtracer_aov_passes < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
     case 'H':
       config.pathtracer_direct_hemisphere_sample = true;
       optind--;
@@ -141,6 +352,60 @@ int main( int argc, char** argv ) {
     }
   }
 
+  // These learn from or race against the render as it goes, so their
+  // results depend on how the threads interleave.
+  if (config.pathtracer_seed >= 0 &&
+      (config.pathtracer_time_budget > 0 || config.pathtracer_path_guiding ||
+       config.pathtracer_irradiance_cache_error > 0 ||
+       config.pathtracer_caustic_photons > 0 || config.pathtracer_bidirectional)) {
+    msg("Warning: --time-budget, --guide, --irradiance-cache, --caustics and --bdpt renders are not reproducible");
+  }
+
+  // Light tracing is only added to the image once rendering ends, the
+  // coordinator of worker processes has no samples of its own until then,
+  // and an interactive render starts over whenever its camera moves.
+  if (config.pathtracer_checkpoint_file != "" &&
+      (config.pathtracer_bidirectional || config.pathtracer_worker_processes > 0 ||
+       config.pathtracer_interactive)) {
+    msg("Warning: --bdpt, --workers and --interactive renders cannot be checkpointed");
+    config.pathtracer_checkpoint_file = "";
+  }
+
+  // Only the samples of one band exist at a time, so nothing may need the
+  // rest of the frame: light tracing splats anywhere, the denoiser filters
+  // across band edges, and checkpoints and worker processes cover the
+  // whole frame.
+  if (config.pathtracer_stream_exr) {
+    if (!write_to_file || x != (size_t) -1 || batch_file != "" || daemon_socket != "") {
+      msg("Error: --stream needs -f and a full frame");
+      return 1;
+    }
+    if (config.pathtracer_bidirectional || config.pathtracer_denoise ||
+        config.pathtracer_checkpoint_file != "" || config.pathtracer_worker_processes > 0) {
+      msg("Warning: --bdpt, --denoise, --checkpoint and --workers are ignored by --stream");
+      config.pathtracer_bidirectional = false;
+      config.pathtracer_denoise = false;
+      config.pathtracer_checkpoint_file = "";
+      config.pathtracer_worker_processes = 0;
+    }
+  }
+
+  // The daemon loads the scenes its requests name.
+  if (daemon_socket != "") {
+    if (config.pathtracer_worker_processes > 0) {
+      msg("Warning: --workers is ignored by the daemon");
+    }
+    RenderDaemon daemon(config);
+    return daemon.serve(daemon_socket);
+  }
+
+  // Worker processes would each trace caustic maps of their own, pass after
+  // pass, for every cell they render.
+  if (config.pathtracer_worker_processes > 0 && config.pathtracer_caustic_photons > 0) {
+    msg("Error: --caustics cannot be used with --workers");
+    return 1;
+  }
+
   // print usage if no argument given
   if (optind >= argc) {
     usage(argv[0]);
@@ -152,6 +417,7 @@ int main( int argc, char** argv ) {
   string sceneFile = sceneFilePath.substr(sceneFilePath.find_last_of('/')+1);
   sceneFile = sceneFile.substr(0,sceneFile.find(".dae"));
   config.pathtracer_filename = sceneFile;
+  config.pathtracer_scene_file = sceneFilePath;
 
   // parse scene
   Collada::SceneInfo *sceneInfo = new Collada::SceneInfo();
@@ -161,16 +427,19 @@ int main( int argc, char** argv ) {
   }
 
   // create application
-  Application *app  = new Application(config, !write_to_file);
+  Application *app  = new Application(config, !write_to_file && batch_file == "");
 
   msg("Rendering using " << config.pathtracer_num_threads << " threads");
 
   // write straight to file without opening a window if -f option provided
-  if (write_to_file) {
+  if (write_to_file || batch_file != "") {
     app->init();
     app->load(sceneInfo);
     delete sceneInfo;
 
+    if (batch_file != "")
+      return render_batch(app, batch_file, w, h, cam_settings);
+
     if (w && h)
       app->resize(w, h);
 
@@ -178,6 +447,7 @@ int main( int argc, char** argv ) {
       app->load_camera(cam_settings);
 
     app->render_to_file(filename, x, y, dx, dy);
+    app->wait_for_writes();
     return 0;
   }
 
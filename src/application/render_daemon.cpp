@@ -0,0 +1,296 @@
+#include "render_daemon.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "CGL/timer.h"
+
+namespace CGL {
+
+RenderDaemon::RenderDaemon(const AppConfig& config, size_t cache_size)
+    : config(config), cacheSize(std::max(cache_size, (size_t)1)), quit(false),
+      listener(-1), clientsActive(0) {
+  // Workers are forked, which a process with render threads cannot do, and
+  // requests would all share one checkpoint file.
+  this->config.pathtracer_worker_processes = 0;
+  this->config.pathtracer_checkpoint_file = "";
+  this->config.pathtracer_interactive = false;
+  this->config.pathtracer_stream_exr = false;
+  this->config.pathtracer_aov_passes = 0;
+  // Renders take turns, so every loaded scene renders on the same threads
+  // instead of keeping a pool of its own.
+  this->config.pathtracer_thread_pool = std::make_shared<ThreadPool>();
+}
+
+RenderDaemon::~RenderDaemon() {
+  for (CachedScene& scene : cache) delete scene.app;
+}
+
+#ifndef _WIN32
+
+namespace {
+
+bool write_fully(int fd, const void* data, size_t size) {
+  const char* p = (const char*) data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Parse a request field that must be a positive integer.
+ */
+bool parse_positive(const std::string& value, size_t* out) {
+  char* end;
+  errno = 0;
+  long n = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || errno == ERANGE || n <= 0 || n > INT_MAX) return false;
+  *out = n;
+  return true;
+}
+
+bool reply_error(int client, const std::string& message) {
+  fprintf(stderr, "[PathTracer] Request failed: %s\n", message.c_str());
+  std::string line = "ERROR " + message + "\n";
+  return write_fully(client, line.data(), line.size());
+}
+
+}  // namespace
+
+int RenderDaemon::serve(const std::string& socket_path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[PathTracer] Socket path too long: %s\n", socket_path.c_str());
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path.c_str());
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path.c_str());
+  if (listener < 0 || bind(listener, (sockaddr*) &addr, sizeof(addr)) != 0 ||
+      listen(listener, 16) != 0) {
+    fprintf(stderr, "[PathTracer] Could not listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+    if (listener >= 0) close(listener);
+    return 1;
+  }
+
+  // A client that hangs up early must not take the daemon down with it.
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "[PathTracer] Listening on %s\n", socket_path.c_str());
+  fflush(stdout);
+
+  while (!quit) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR && !quit) continue;
+      if (!quit) fprintf(stderr, "[PathTracer] accept failed: %s\n", strerror(errno));
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> lk(clientsLock);
+      clientsActive++;
+    }
+    std::thread([this, client] {
+      handle(client);
+      close(client);
+      std::lock_guard<std::mutex> lk(clientsLock);
+      if (--clientsActive == 0) clientsDone.notify_all();
+    }).detach();
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(clientsLock);
+    clientsDone.wait(lk, [this] { return clientsActive == 0; });
+  }
+  close(listener);
+  unlink(socket_path.c_str());
+  fprintf(stdout, "[PathTracer] Daemon stopped.\n");
+  return 0;
+}
+
+Application* RenderDaemon::get_scene(const std::string& path, bool* cached, std::string* error) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    *error = "cannot open scene " + path;
+    return NULL;
+  }
+
+  for (auto it = cache.begin(); it != cache.end(); ++it) {
+    if (it->path != path) continue;
+    if (it->mtime == st.st_mtime) {
+      cache.splice(cache.begin(), cache, it);
+      *cached = true;
+      return it->app;
+    }
+    delete it->app;
+    cache.erase(it);
+    break;
+  }
+
+  *cached = false;
+  Collada::SceneInfo* sceneInfo = new Collada::SceneInfo();
+  if (Collada::ColladaParser::load(path.c_str(), sceneInfo) < 0) {
+    delete sceneInfo;
+    *error = "cannot parse scene " + path;
+    return NULL;
+  }
+
+  AppConfig scene_config = config;
+  string sceneFile = path.substr(path.find_last_of('/') + 1);
+  scene_config.pathtracer_filename = sceneFile.substr(0, sceneFile.find(".dae"));
+  scene_config.pathtracer_scene_file = path;
+  Application* app = new Application(scene_config, false);
+  app->init();
+  app->load(sceneInfo);
+  delete sceneInfo;
+
+  CachedScene entry = {path, st.st_mtime, app};
+  cache.push_front(entry);
+  while (cache.size() > cacheSize) {
+    delete cache.back().app;
+    cache.pop_back();
+  }
+  return app;
+}
+
+void RenderDaemon::handle(int client) {
+  std::string line;
+  char c;
+  while (line.size() < 4096 && read(client, &c, 1) == 1 && c != '\n') line += c;
+
+  std::istringstream fields(line);
+  std::string command;
+  fields >> command;
+  if (command == "shutdown") {
+    quit = true;
+    ::shutdown(listener, SHUT_RDWR);
+    write_fully(client, "OK 0\n\n", 6);
+    return;
+  }
+  if (command != "render") {
+    reply_error(client, "unknown request '" + command + "'");
+    return;
+  }
+
+  std::string scene_path, camera_path;
+  size_t width = 0, height = 0, spp = config.pathtracer_ns_aa;
+  size_t x = -1, y = 0, dx = 0, dy = 0;
+  std::string field;
+  while (fields >> field) {
+    size_t eq = field.find('=');
+    std::string key = field.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : field.substr(eq + 1);
+    if (key == "scene") {
+      scene_path = value;
+    } else if (key == "camera") {
+      camera_path = value;
+    } else if (key == "width" || key == "height" || key == "spp") {
+      size_t* count = key == "width" ? &width : key == "height" ? &height : &spp;
+      if (!parse_positive(value, count)) {
+        reply_error(client, key + " must be a positive integer");
+        return;
+      }
+    } else if (key == "region") {
+      int rx, ry, rdx, rdy;
+      if (sscanf(value.c_str(), "%d,%d,%d,%d", &rx, &ry, &rdx, &rdy) != 4 ||
+          rx < 0 || ry < 0 || rdx <= 0 || rdy <= 0) {
+        reply_error(client, "region must be <x>,<y>,<dx>,<dy>");
+        return;
+      }
+      x = rx; y = ry; dx = rdx; dy = rdy;
+    } else {
+      reply_error(client, "unknown field '" + key + "'");
+      return;
+    }
+  }
+  if (scene_path == "" || width == 0 || height == 0 || spp == 0) {
+    reply_error(client, "render needs scene, width and height");
+    return;
+  }
+  if (x != (size_t) -1 && (x + dx > width || y + dy > height)) {
+    reply_error(client, "region outside the image");
+    return;
+  }
+  if (camera_path != "" && !std::ifstream(camera_path)) {
+    reply_error(client, "cannot open camera settings " + camera_path);
+    return;
+  }
+
+  std::vector<unsigned char> png;
+  std::vector<std::pair<std::string, std::string>> stats;
+  {
+    std::lock_guard<std::mutex> lk(renderLock);
+    Timer timer;
+    timer.start();
+    bool cached;
+    std::string error;
+    Application* app = get_scene(scene_path, &cached, &error);
+    if (!app) {
+      reply_error(client, error);
+      return;
+    }
+    timer.stop();
+    char buf[64];
+    if (cached) {
+      snprintf(buf, sizeof(buf), "hit");
+    } else {
+      snprintf(buf, sizeof(buf), "miss (%.4f s to load)", timer.duration());
+    }
+
+    app->set_samples_per_pixel(spp);
+    app->resize(width, height);
+    if (camera_path != "") {
+      app->load_camera(camera_path);
+    } else {
+      app->reset_camera();
+    }
+    stats = app->render_to_png(png, x, y, dx, dy);
+    stats.push_back(std::make_pair("Scene cache", std::string(buf)));
+  }
+
+  std::ostringstream header;
+  header << "OK " << png.size() << "\n";
+  for (const auto& stat : stats) header << stat.first << ": " << stat.second << "\n";
+  header << "\n";
+  std::string text = header.str();
+  if (write_fully(client, text.data(), text.size())) {
+    write_fully(client, png.data(), png.size());
+  }
+}
+
+#else
+
+int RenderDaemon::serve(const std::string& socket_path) {
+  fprintf(stderr, "[PathTracer] The render daemon is not supported on this platform.\n");
+  return 1;
+}
+
+Application* RenderDaemon::get_scene(const std::string& path, bool* cached, std::string* error) {
+  return NULL;
+}
+
+void RenderDaemon::handle(int client) {}
+
+#endif
+
+}  // namespace CGL
@@ -0,0 +1,81 @@
+#ifndef CGL_RENDER_DAEMON_H
+#define CGL_RENDER_DAEMON_H
+
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "application.h"
+
+namespace CGL {
+
+/**
+ * Serves render requests on a Unix domain socket, keeping recently used
+ * scenes loaded so repeated previews of the same scene pay neither the
+ * Collada parse nor the BVH build.
+ *
+ * A client sends one request line per connection:
+ *
+ *   render scene=<path.dae> width=<INT> height=<INT> [spp=<INT>]
+ *          [region=<x>,<y>,<dx>,<dy>] [camera=<settings file>]
+ *
+ * and gets back "OK <bytes>", the render stats as "<name>: <value>" lines,
+ * an empty line and the PNG; or a single "ERROR <message>" line. A
+ * "shutdown" request stops the daemon once the renders in progress are done.
+ *
+ * Connections are served concurrently, but renders take turns: each render
+ * already keeps every thread busy. The loaded scenes all render on one
+ * shared pool of threads.
+ */
+class RenderDaemon {
+ public:
+
+  /**
+   * \param config render settings every request starts from
+   * \param cache_size number of scenes kept loaded
+   */
+  RenderDaemon(const AppConfig& config, size_t cache_size = 4);
+  ~RenderDaemon();
+
+  /**
+   * Listen on a socket at the given path until a shutdown request. Returns
+   * the process exit status.
+   */
+  int serve(const std::string& socket_path);
+
+ private:
+
+  struct CachedScene {
+    std::string path;
+    time_t mtime;            ///< modification time of the file when it was loaded
+    Application* app;
+  };
+
+  /**
+   * The loaded scene of the file, from the cache if the file has not changed
+   * since it was loaded. Returns NULL and sets the error if it cannot be
+   * loaded.
+   */
+  Application* get_scene(const std::string& path, bool* cached, std::string* error);
+
+  void handle(int client);
+
+  AppConfig config;
+  size_t cacheSize;
+  std::list<CachedScene> cache;   ///< most recently used first
+  std::mutex renderLock;          ///< held by the request that is rendering
+  std::atomic<bool> quit;         ///< a shutdown was requested
+  int listener;                   ///< listening socket
+
+  std::mutex clientsLock;
+  std::condition_variable clientsDone;
+  size_t clientsActive;           ///< connections still being served
+};
+
+}  // namespace CGL
+
+#endif  // CGL_RENDER_DAEMON_H
@@ -79,6 +79,24 @@ public:
 
     virtual void raytrace_cell(ImageBuffer& buffer) = 0;
 
+    /**
+     * Like render_to_file, but encode the image as PNG into memory. Returns
+     * the render's statistics as name and value pairs.
+     */
+    virtual std::vector<std::pair<std::string, std::string>> render_to_png(
+        std::vector<unsigned char>& png, size_t x, size_t y, size_t dx, size_t dy) = 0;
+
+    /**
+     * Set the number of camera rays per pixel of renders started from now on.
+     */
+    virtual void set_samples_per_pixel(size_t ns_aa) = 0;
+
+    /**
+     * Restart an interactive render that was stopped to move the camera,
+     * from the old frame reprojected to the new view.
+     */
+    virtual void camera_moved() = 0;
+
     /**
      * If the pathtracer is in VISUALIZE, handle key presses to traverse the bvh.
      */
@@ -94,6 +112,11 @@ public:
      */
     virtual void save_sampling_rate_image(std::string filename) = 0;
 
+    /**
+     * Wait until the images saved so far are on disk.
+     */
+    virtual void wait_for_writes() = 0;
+
     Vector2D cell_tl, cell_br;
     bool render_cell;
 };
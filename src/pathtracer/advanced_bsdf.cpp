@@ -19,11 +19,11 @@ Vector3D MirrorBSDF::f(const Vector3D wo, const Vector3D wi) {
 }
 
 Vector3D MirrorBSDF::sample_f(const Vector3D wo, Vector3D* wi, double* pdf) {
-
-  // TODO:
-  // Implement MirrorBSDF
-  
-  return Vector3D();
+  // A delta distribution: all light leaves in the reflected direction. The
+  // cosine is divided out since the integrator multiplies it back in.
+  reflect(wo, wi);
+  *pdf = 1.0;
+  return reflectance / abs_cos_theta(*wi);
 }
 
 void MirrorBSDF::render_debugger_node()
@@ -97,12 +97,13 @@ Vector3D RefractionBSDF::f(const Vector3D wo, const Vector3D wi) {
 }
 
 Vector3D RefractionBSDF::sample_f(const Vector3D wo, Vector3D* wi, double* pdf) {
+  *pdf = 1.0;
+  if (!refract(wo, wi, ior)) return Vector3D();
 
-  // TODO:
-  // Implement RefractionBSDF
-  
-  
-  return Vector3D();
+  // Radiance scales by eta^2 crossing the interface, eta being the ratio of
+  // the indices of refraction on the wo and wi sides.
+  double eta = wo.z > 0 ? 1.0 / ior : ior;
+  return transmittance / abs_cos_theta(*wi) * (eta * eta);
 }
 
 void RefractionBSDF::render_debugger_node()
@@ -122,15 +123,27 @@ Vector3D GlassBSDF::f(const Vector3D wo, const Vector3D wi) {
 }
 
 Vector3D GlassBSDF::sample_f(const Vector3D wo, Vector3D* wi, double* pdf) {
+  // Total internal reflection.
+  if (!refract(wo, wi, ior)) {
+    reflect(wo, wi);
+    *pdf = 1.0;
+    return reflectance / abs_cos_theta(*wi);
+  }
 
-  // TODO:
-  // Compute Fresnel coefficient and either reflect or refract based on it.
-
-  // compute Fresnel coefficient and use it as the probability of reflection
-  // - Fundamentals of Computer Graphics page 305
-
+  // Schlick's approximation of the Fresnel coefficient is the probability
+  // of reflecting rather than refracting.
+  double r0 = (1 - ior) / (1 + ior);
+  r0 *= r0;
+  double R = r0 + (1 - r0) * pow(1 - abs_cos_theta(wo), 5);
+  if (sample_1d() < R) {
+    reflect(wo, wi);
+    *pdf = R;
+    return R * reflectance / abs_cos_theta(*wi);
+  }
 
-  return Vector3D();
+  double eta = wo.z > 0 ? 1.0 / ior : ior;
+  *pdf = 1 - R;
+  return (1 - R) * transmittance / abs_cos_theta(*wi) * (eta * eta);
 }
 
 void GlassBSDF::render_debugger_node()
@@ -145,27 +158,19 @@ void GlassBSDF::render_debugger_node()
 }
 
 void BSDF::reflect(const Vector3D wo, Vector3D* wi) {
-
-  // TODO:
-  // Implement reflection of wo about normal (0,0,1) and store result in wi.
-  
-
-
+  *wi = Vector3D(-wo.x, -wo.y, wo.z);
 }
 
 bool BSDF::refract(const Vector3D wo, Vector3D* wi, double ior) {
-
-  // TODO:
-  // Use Snell's Law to refract wo surface and store result ray in wi.
-  // Return false if refraction does not occur due to total internal reflection
-  // and true otherwise. When dot(wo,n) is positive, then wo corresponds to a
-  // ray entering the surface through vacuum.
-
-
-
-
+  // When dot(wo,n) is positive, wo corresponds to a ray entering the surface
+  // through vacuum.
+  double eta = wo.z > 0 ? 1.0 / ior : ior;
+  double cos2 = 1 - eta * eta * (1 - wo.z * wo.z);
+  if (cos2 < 0) return false;
+
+  double cos_t = sqrt(cos2);
+  *wi = Vector3D(-eta * wo.x, -eta * wo.y, wo.z > 0 ? -cos_t : cos_t);
   return true;
-
 }
 
 } // namespace CGL
@@ -0,0 +1,386 @@
+#include "bdpt.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "pathtracer/pathtracer.h"
+#include "pathtracer/bsdf.h"
+#include "util/random_util.h"
+
+using namespace CGL::SceneObjects;
+
+namespace CGL {
+
+static inline double remap0(double pdf) {
+  return pdf != 0 ? pdf : 1;
+}
+
+static inline void atomic_add(std::atomic<float>& a, float v) {
+  float old = a.load(std::memory_order_relaxed);
+  while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) { }
+}
+
+BidirectionalPathTracer::BidirectionalPathTracer() : pt(NULL) { }
+
+void BidirectionalPathTracer::reset(PathTracer* pt, size_t num_threads) {
+  this->pt = pt;
+
+  lights.clear();
+  for (SceneLight* light : pt->scene->lights) {
+    double pdf_pos, pdf_dir;
+    light->photon_pdf(Vector3D(0, 0, 1), &pdf_pos, &pdf_dir);
+    if (pdf_pos > 0) lights.push_back(light);
+  }
+
+  // Light tracing hits are few next to camera samples, so the threads
+  // rarely land on the same pixel at once and one film serves them all.
+  num_threads = std::max(num_threads, (size_t)1);
+  std::vector<std::atomic<float>> cleared(pt->sampleBuffer.w * pt->sampleBuffer.h * 3);
+  for (std::atomic<float>& value : cleared) value.store(0, std::memory_order_relaxed);
+  film.swap(cleared);
+  cameraPaths.assign(num_threads, std::vector<Vertex>(pt->max_ray_depth + 2));
+  lightPaths.assign(num_threads, std::vector<Vertex>(pt->max_ray_depth + 1));
+}
+
+Vector3D BidirectionalPathTracer::radiance(const Ray &r, size_t thread,
+                                           Intersection *first_hit) {
+  Vertex* camera_path = &cameraPaths[thread][0];
+  Vertex* light_path = &lightPaths[thread][0];
+  int max_depth = pt->max_ray_depth;
+
+  Vertex& camera = camera_path[0];
+  camera.type = Vertex::CAMERA;
+  camera.p = r.o;
+  camera.n = Vector3D();
+  camera.bsdf = NULL;
+  camera.light = NULL;
+  camera.beta = Vector3D(1, 1, 1);
+  camera.delta = false;
+  camera.pdfFwd = 1;
+  camera.pdfRev = 0;
+  int num_camera = 1 + random_walk(r, camera.beta, pt->camera->direction_pdf(r.d),
+                                   max_depth + 1, &camera_path[0], camera_path + 1,
+                                   first_hit);
+
+  int num_light = 0;
+  if (!lights.empty()) {
+    size_t index = std::min((size_t) (random_uniform() * lights.size()), lights.size() - 1);
+    const SceneLight* light = lights[index];
+    Vector3D o, d;
+    Vector3D power = light->sample_photon(&o, &d) * lights.size();
+    double pdf_pos, pdf_dir;
+    light->photon_pdf(d, &pdf_pos, &pdf_dir);
+    if (power.illum() > 0 && pdf_dir > 0) {
+      Vertex& v = light_path[0];
+      v.type = Vertex::LIGHT;
+      v.p = o;
+      v.n = light->photon_normal();
+      v.bsdf = NULL;
+      v.light = light;
+      v.beta = power;
+      v.delta = false;
+      v.pdfFwd = pdf_pos / lights.size();
+      v.pdfRev = 0;
+      num_light = 1 + random_walk(Ray(o, d), power, pdf_dir, max_depth,
+                                  &light_path[0], light_path + 1, NULL);
+    }
+  }
+
+  // Strategy (s, t) joins the first s light vertices to the first t camera
+  // vertices, for paths of s + t - 2 bounces.
+  Vector3D L;
+  for (int t = 1; t <= num_camera; t++) {
+    for (int s = 0; s <= num_light; s++) {
+      int depth = s + t - 2;
+      if ((s == 1 && t == 1) || depth < 0 || depth > max_depth) continue;
+
+      Vector2D raster;
+      Vector3D contribution = connect(light_path, camera_path, s, t, &raster);
+      if (t != 1) {
+        L += contribution;
+      } else if (contribution.illum() != 0) {
+        size_t w = pt->sampleBuffer.w, h = pt->sampleBuffer.h;
+        size_t x = std::min((size_t) (raster.x * w), w - 1);
+        size_t y = std::min((size_t) (raster.y * h), h - 1);
+        std::atomic<float>* pixel = &film[(x + y * w) * 3];
+        atomic_add(pixel[0], contribution.x);
+        atomic_add(pixel[1], contribution.y);
+        atomic_add(pixel[2], contribution.z);
+      }
+    }
+  }
+  return L;
+}
+
+void BidirectionalPathTracer::resolve(size_t x0, size_t y0, size_t x1, size_t y1) {
+  // Every camera sample traced one light subpath, and the light image is an
+  // estimate over all of them.
+  double samples = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      samples += pt->sampleCountBuffer[x + y * pt->sampleBuffer.w];
+    }
+  }
+  if (samples == 0) return;
+  double scale = pt->sampleBuffer.w * pt->sampleBuffer.h / samples;
+
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      size_t i = x + y * pt->sampleBuffer.w;
+      Vector3D sum(film[i * 3], film[i * 3 + 1], film[i * 3 + 2]);
+      pt->sampleBuffer.data[i] = Vector3D(pt->sampleBuffer.data[i]) + sum * scale;
+    }
+  }
+}
+
+int BidirectionalPathTracer::random_walk(Ray ray, Vector3D beta, double pdf_dir,
+                                         int max_vertices, Vertex* prev, Vertex* path,
+                                         Intersection* first_hit) {
+  if (max_vertices <= 0) return 0;
+
+  double pdf_fwd = pdf_dir, pdf_rev = 0;
+  int n = 0;
+  while (true) {
+    ray.min_t = EPS_F;
+    Intersection isect;
+    if (!pt->bvh->intersect(ray, &isect)) break;
+    if (n == 0 && first_hit) *first_hit = isect;
+    if (n == 0 && prev->type == Vertex::LIGHT) {
+      beta *= prev->light->photon_arrival(isect.t * ray.d.norm());
+    }
+
+    Vertex& v = path[n++];
+    v.type = Vertex::SURFACE;
+    v.p = ray.o + ray.d * isect.t;
+    v.bsdf = isect.bsdf;
+    v.light = NULL;
+    v.delta = isect.bsdf->is_delta();
+    v.wo = -ray.d;
+    v.beta = beta;
+    v.pdfRev = 0;
+
+    // Non-delta surfaces shade both sides alike; glass needs to know which
+    // side it is entered from.
+    v.n = isect.n;
+    if (!v.delta && dot(v.n, v.wo) < 0) v.n = -v.n;
+    v.pdfFwd = convert(pdf_fwd, *prev, v);
+    if (n >= max_vertices) break;
+
+    Matrix3x3 o2w;
+    make_coord_space(o2w, v.n);
+    Matrix3x3 w2o = o2w.T();
+    Vector3D wo = w2o * v.wo, wi;
+    double pdf;
+    Vector3D f = v.bsdf->sample_f(wo, &wi, &pdf);
+    if (pdf <= 0 || f.illum() == 0) break;
+    beta = beta * f * abs_cos_theta(wi) / pdf;
+
+    // Delta vertices cannot be connected to, and their densities drop out
+    // of the weights.
+    if (v.delta) {
+      pdf_fwd = pdf_rev = 0;
+    } else {
+      pdf_fwd = pdf;
+      pdf_rev = v.bsdf->pdf(wi, wo);
+    }
+    prev->pdfRev = convert(pdf_rev, v, *prev);
+    prev = &v;
+    ray = Ray(v.p, o2w * wi);
+  }
+  return n;
+}
+
+Vector3D BidirectionalPathTracer::connect(Vertex* light_path, Vertex* camera_path,
+                                          int s, int t, Vector2D* raster) {
+  Vertex sampled;
+  Vector3D L;
+
+  if (s == 0) {
+    // Camera paths only see emission through delta vertices; everything
+    // else is covered by the strategies that sample lights.
+    const Vertex& v = camera_path[t - 1];
+    if (v.type != Vertex::SURFACE) return L;
+    for (int i = 1; i < t - 1; i++) {
+      if (!camera_path[i].delta) return L;
+    }
+    return v.beta * v.bsdf->get_emission();
+  }
+
+  if (t == 1) {
+    // Light tracing: connect the light subpath to the pinhole.
+    const Vertex& qs = light_path[s - 1];
+    if (qs.delta || qs.type != Vertex::SURFACE) return L;
+    Vector3D eye = pt->camera->position();
+    if (!pt->camera->project(qs.p, raster)) return L;
+
+    Vector3D d = qs.p - eye;
+    double dist2 = d.norm2();
+    double pdf_eye = pt->camera->direction_pdf(d);
+    Vector3D w = -d / sqrt(dist2);
+    double cos_q = dot(qs.n, w);
+    if (pdf_eye <= 0 || cos_q <= 0) return L;
+
+    // The camera's importance is its direction density over the cosine to
+    // the view axis, and that cosine cancels against the geometry term.
+    L = qs.beta * f(qs, eye) * (cos_q * pdf_eye / dist2);
+    if (L.illum() == 0 || !visible(qs.p, eye)) return Vector3D();
+
+    sampled.type = Vertex::CAMERA;
+    sampled.p = eye;
+    sampled.n = Vector3D();
+    sampled.bsdf = NULL;
+    sampled.light = NULL;
+    sampled.delta = false;
+    sampled.pdfFwd = 1;
+  } else if (s == 1) {
+    // Sample a point on a light, as in next event estimation.
+    const Vertex& v = camera_path[t - 1];
+    if (v.delta) return L;
+    size_t index = std::min((size_t) (random_uniform() * lights.size()), lights.size() - 1);
+    const SceneLight* light = lights[index];
+
+    Vector3D wi;
+    double dist, pdf;
+    Vector3D Le = light->sample_L(v.p, &wi, &dist, &pdf);
+    if (pdf <= 0 || Le.illum() == 0) return L;
+    double cos_v = dot(v.n, wi);
+    if (cos_v <= 0) return L;
+
+    // Point lights report the light arriving at v.p, which the light
+    // subpaths match through photon_arrival. Area lights get their solid
+    // angle density from the same position density the light subpaths
+    // use, so that the strategies agree.
+    double pdf_pos, pdf_dir;
+    light->photon_pdf(-wi, &pdf_pos, &pdf_dir);
+    if (!light->is_delta_light()) {
+      double cos_l = fabs(dot(light->photon_normal(), wi));
+      if (cos_l <= 0) return L;
+      pdf = pdf_pos * dist * dist / cos_l;
+    }
+    L = v.beta * f(v, v.p + wi) * Le * (cos_v * lights.size() / pdf);
+    if (L.illum() == 0 || !visible(v.p, v.p + wi * dist)) return Vector3D();
+
+    sampled.type = Vertex::LIGHT;
+    sampled.p = v.p + wi * dist;
+    sampled.n = light->photon_normal();
+    sampled.bsdf = NULL;
+    sampled.light = light;
+    sampled.delta = false;
+    sampled.pdfFwd = pdf_pos / lights.size();
+  } else {
+    const Vertex& qs = light_path[s - 1];
+    const Vertex& v = camera_path[t - 1];
+    if (qs.delta || v.delta) return L;
+
+    Vector3D d = v.p - qs.p;
+    double dist2 = d.norm2();
+    Vector3D w = d / sqrt(dist2);
+    double cos_q = dot(qs.n, w), cos_v = -dot(v.n, w);
+    if (cos_q <= 0 || cos_v <= 0) return L;
+
+    L = qs.beta * f(qs, v.p) * f(v, qs.p) * v.beta * (cos_q * cos_v / dist2);
+    if (L.illum() == 0 || !visible(qs.p, v.p)) return Vector3D();
+  }
+
+  return L * mis_weight(light_path, camera_path, sampled, s, t);
+}
+
+double BidirectionalPathTracer::mis_weight(Vertex* light_path, Vertex* camera_path,
+                                           const Vertex& sampled, int s, int t) {
+  if (s + t == 2) return 1;
+
+  // A sampled endpoint stands in for the subpath's own, and the connection
+  // changes the reverse densities of the two vertices on either side of it.
+  // Set those for the duration of the weight computation.
+  Vertex saved_light = light_path[0], saved_camera = camera_path[0];
+  if (s == 1) light_path[0] = sampled;
+  if (t == 1) camera_path[0] = sampled;
+
+  Vertex* qs = &light_path[s - 1];
+  Vertex* v = &camera_path[t - 1];
+  Vertex* qs_minus = s > 1 ? &light_path[s - 2] : NULL;
+  Vertex* v_minus = t > 1 ? &camera_path[t - 2] : NULL;
+
+  double saved_v = v->pdfRev, saved_q = qs->pdfRev;
+  double saved_v_minus = v_minus ? v_minus->pdfRev : 0;
+  double saved_q_minus = qs_minus ? qs_minus->pdfRev : 0;
+
+  v->pdfRev = pdf(*qs, qs_minus, *v);
+  if (v_minus) v_minus->pdfRev = pdf(*v, qs, *v_minus);
+  qs->pdfRev = pdf(*v, v_minus, *qs);
+  if (qs_minus) qs_minus->pdfRev = pdf(*qs, v, *qs_minus);
+
+  // Ratios of the other strategies' densities to this one's, walking the
+  // connection towards either end. Strategies that would connect to a
+  // delta vertex cannot sample the path.
+  double sum = 0, ratio = 1;
+  for (int i = t - 1; i > 0; i--) {
+    ratio *= remap0(camera_path[i].pdfRev) / remap0(camera_path[i].pdfFwd);
+    if (!camera_path[i].delta && !camera_path[i - 1].delta) sum += ratio;
+  }
+
+  // Walking the light end down to s = 0 would make the camera path hit the
+  // light, which is not a strategy here except where it is the only one.
+  ratio = 1;
+  for (int i = s - 1; i > 0; i--) {
+    ratio *= remap0(light_path[i].pdfRev) / remap0(light_path[i].pdfFwd);
+    if (!light_path[i].delta && !light_path[i - 1].delta) sum += ratio;
+  }
+
+  v->pdfRev = saved_v;
+  qs->pdfRev = saved_q;
+  if (v_minus) v_minus->pdfRev = saved_v_minus;
+  if (qs_minus) qs_minus->pdfRev = saved_q_minus;
+  light_path[0] = saved_light;
+  camera_path[0] = saved_camera;
+  return 1 / (1 + sum);
+}
+
+Vector3D BidirectionalPathTracer::f(const Vertex& v, const Vector3D& toward) const {
+  Matrix3x3 o2w;
+  make_coord_space(o2w, v.n);
+  Matrix3x3 w2o = o2w.T();
+  Vector3D wo = w2o * v.wo;
+  Vector3D wi = w2o * (toward - v.p).unit();
+  if (wo.z <= 0 || wi.z <= 0) return Vector3D();
+  return v.bsdf->f(wo, wi);
+}
+
+double BidirectionalPathTracer::pdf(const Vertex& v, const Vertex* prev,
+                                    const Vertex& next) const {
+  Vector3D w = (next.p - v.p).unit();
+  double pdf_dir = 0;
+  if (v.type == Vertex::LIGHT) {
+    double pdf_pos;
+    v.light->photon_pdf(w, &pdf_pos, &pdf_dir);
+  } else if (v.type == Vertex::CAMERA) {
+    pdf_dir = pt->camera->direction_pdf(w);
+  } else if (!v.delta && prev) {
+    Matrix3x3 o2w;
+    make_coord_space(o2w, v.n);
+    Matrix3x3 w2o = o2w.T();
+    pdf_dir = v.bsdf->pdf(w2o * (prev->p - v.p).unit(), w2o * w);
+  }
+  return convert(pdf_dir, v, next);
+}
+
+double BidirectionalPathTracer::convert(double pdf_dir, const Vertex& from,
+                                        const Vertex& to) const {
+  Vector3D w = to.p - from.p;
+  double dist2 = w.norm2();
+  if (dist2 == 0) return 0;
+  double pdf = pdf_dir / dist2;
+  if (to.n.norm2() > 0) pdf *= fabs(dot(to.n, w)) / sqrt(dist2);
+  return pdf;
+}
+
+bool BidirectionalPathTracer::visible(const Vector3D& a, const Vector3D& b) const {
+  Vector3D d = b - a;
+  double dist = d.norm();
+  Ray shadow(a, d / dist);
+  shadow.min_t = EPS_F;
+  shadow.max_t = dist - EPS_F;
+  return !pt->bvh->has_intersection(shadow);
+}
+
+}  // namespace CGL
@@ -0,0 +1,97 @@
+#ifndef CGL_BDPT_H
+#define CGL_BDPT_H
+
+#include <atomic>
+#include <vector>
+
+#include "CGL/vector3D.h"
+#include "pathtracer/ray.h"
+#include "pathtracer/intersection.h"
+#include "scene/scene.h"
+#include "util/image.h"
+
+namespace CGL {
+
+class PathTracer;
+
+/**
+ * Bidirectional path tracing (Veach and Guibas 1995), in the formulation of
+ * Physically Based Rendering (3rd ed., chapter 16).
+ *
+ * Every camera sample traces a camera subpath and a light subpath and
+ * connects every prefix of one to every prefix of the other, weighting each
+ * connection by the balance heuristic over all the ways the same path could
+ * have been sampled. Connections of light subpaths straight to the camera
+ * (light tracing) land on arbitrary pixels; they go to a film shared by the
+ * render threads, added to the image by resolve() once rendering ends.
+ *
+ * Lights are sampled through SceneLight::sample_photon and friends, so only
+ * area and point lights take part; environment lighting is ignored. Emission
+ * is only picked up by camera paths where no other strategy can reach it,
+ * i.e. directly or through mirrors and glass, since this renderer has no way
+ * from emissive geometry back to the light it belongs to.
+ */
+class BidirectionalPathTracer {
+ public:
+
+  BidirectionalPathTracer();
+
+  /**
+   * Prepare for a render of the path tracer's current scene and frame on up
+   * to num_threads threads. Clears the light tracing film.
+   */
+  void reset(PathTracer* pt, size_t num_threads);
+
+  /**
+   * Estimate the radiance along a camera ray, adding light tracing
+   * contributions to the film.
+   * \param first_hit address to store the ray's first intersection
+   */
+  Vector3D radiance(const Ray& r, size_t thread, SceneObjects::Intersection* first_hit);
+
+  /**
+   * Add the light tracing film, normalized by the samples taken over the
+   * region, to the path tracer's sample buffer over the region.
+   */
+  void resolve(size_t x0, size_t y0, size_t x1, size_t y1);
+
+ private:
+
+  struct Vertex {
+    enum Type { CAMERA, LIGHT, SURFACE };
+    Type type;
+    Vector3D p;            ///< position
+    Vector3D n;            ///< shading normal, facing the path; zero at the camera and point lights
+    Vector3D wo;           ///< unit direction towards the previous vertex of the subpath
+    BSDF* bsdf;            ///< surface vertices only
+    const SceneObjects::SceneLight* light;  ///< light vertices only
+    Vector3D beta;         ///< throughput of the subpath up to here
+    bool delta;            ///< scatters through a delta BSDF
+    double pdfFwd;         ///< area density of this vertex as sampled by its subpath
+    double pdfRev;         ///< area density of this vertex as sampled from the other end
+  };
+
+  int random_walk(Ray ray, Vector3D beta, double pdf_dir, int max_vertices,
+                  Vertex* prev, Vertex* path, SceneObjects::Intersection* first_hit);
+
+  Vector3D connect(Vertex* light_path, Vertex* camera_path, int s, int t,
+                   Vector2D* raster);
+  double mis_weight(Vertex* light_path, Vertex* camera_path,
+                    const Vertex& sampled, int s, int t);
+
+  Vector3D f(const Vertex& v, const Vector3D& toward) const;
+  double pdf(const Vertex& v, const Vertex* prev, const Vertex& next) const;
+  double convert(double pdf_dir, const Vertex& from, const Vertex& to) const;
+  bool visible(const Vector3D& a, const Vector3D& b) const;
+
+  PathTracer* pt;
+  std::vector<SceneObjects::SceneLight*> lights;   ///< lights that can start light subpaths
+
+  std::vector<std::atomic<float>> film;            ///< light tracing contributions, RGB per pixel
+  std::vector<std::vector<Vertex>> cameraPaths;    ///< camera subpath storage per thread
+  std::vector<std::vector<Vertex>> lightPaths;     ///< light subpath storage per thread
+};
+
+}  // namespace CGL
+
+#endif  // CGL_BDPT_H
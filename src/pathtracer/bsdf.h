@@ -83,6 +83,19 @@ class BSDF {
    */
   virtual Vector3D sample_f (const Vector3D wo, Vector3D* wi, double* pdf) = 0;
 
+  /**
+   * Density with which sample_f would choose the incident direction wi,
+   * given the outgoing direction wo, both in local space. The default is the
+   * cosine-weighted hemisphere used by the non-delta BSDFs here; delta BSDFs
+   * have no density and are never asked.
+   * \param wo outgoing light direction in local space of point of intersection
+   * \param wi incident light direction in local space of point of intersection
+   * \return solid angle density of sampling wi
+   */
+  virtual double pdf (const Vector3D wo, const Vector3D wi) {
+    return std::max(cos_theta(wi), 0.0) / PI;
+  }
+
   /**
    * Get the emission value of the surface material. For non-emitting surfaces
    * this would be a zero energy Vector3D.
@@ -90,6 +103,14 @@ class BSDF {
    */
   virtual Vector3D get_emission () const = 0;
 
+  /**
+   * Get the albedo of the surface material: the fraction of light it scatters
+   * per color channel, regardless of direction. Used as a guide feature by the
+   * denoiser. Materials without a simple albedo report white.
+   * \return albedo Vector3D of the surface material
+   */
+  virtual Vector3D get_albedo () const { return Vector3D(1.0); }
+
   /**
    * If the BSDF is a delta distribution. Materials that are perfectly specular,
    * (e.g. water, glass, mirror) only scatter light from a single incident angle
@@ -131,6 +152,7 @@ class DiffuseBSDF : public BSDF {
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
   Vector3D get_emission() const { return Vector3D(); }
+  Vector3D get_albedo() const { return reflectance; }
   bool is_delta() const { return false; }
 
   void render_debugger_node();
@@ -203,6 +225,7 @@ class MirrorBSDF : public BSDF {
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
   Vector3D get_emission() const { return Vector3D(); }
+  Vector3D get_albedo() const { return reflectance; }
   bool is_delta() const { return true; }
 
   void render_debugger_node();
@@ -226,6 +249,7 @@ class RefractionBSDF : public BSDF {
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
   Vector3D get_emission() const { return Vector3D(); }
+  Vector3D get_albedo() const { return transmittance; }
   bool is_delta() const { return true; }
 
   void render_debugger_node();
@@ -252,6 +276,7 @@ class GlassBSDF : public BSDF {
   Vector3D f(const Vector3D wo, const Vector3D wi);
   Vector3D sample_f(const Vector3D wo, Vector3D* wi, double* pdf);
   Vector3D get_emission() const { return Vector3D(); }
+  Vector3D get_albedo() const { return transmittance; }
   bool is_delta() const { return true; }
 
   void render_debugger_node();
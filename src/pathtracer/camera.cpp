@@ -202,6 +202,27 @@ Ray Camera::generate_ray(double x, double y) const {
   return Ray(pos, direction);
 }
 
+bool Camera::project(const Vector3D& p, Vector2D* xy) const {
+  Vector3D d = c2w.T() * (p - pos);
+  if (d.z >= 0) return false;
+  double x = (d.x / -d.z / tan(0.5 * hFov * PI / 180.0) + 1) / 2;
+  double y = (d.y / -d.z / tan(0.5 * vFov * PI / 180.0) + 1) / 2;
+  if (x < 0 || x >= 1 || y < 0 || y >= 1) return false;
+  *xy = Vector2D(x, y);
+  return true;
+}
+
+double Camera::direction_pdf(const Vector3D& dir) const {
+  Vector2D xy;
+  if (!project(pos + dir, &xy)) return 0;
+
+  // generate_ray spreads (x, y) over a sensor at distance 1, and a patch of
+  // it subtends cos^3 of its area as solid angle.
+  double area = 4 * tan(0.5 * hFov * PI / 180.0) * tan(0.5 * vFov * PI / 180.0);
+  double cos_theta = -(c2w.T() * dir.unit()).z;
+  return 1 / (area * cos_theta * cos_theta * cos_theta);
+}
+
 } // namespace CGL
 
 #pragma clang diagnostic pop
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #include "scene/collada/camera_info.h"
 #include "CGL/matrix3x3.h"
+#include "CGL/vector2D.h"
 
 #include "math.h"
 #include "ray.h"
@@ -90,6 +91,21 @@ class Camera {
 
   Ray generate_ray_for_thin_lens(double x, double y, double rndR, double rndTheta) const;
 
+  /**
+   * Inverse of generate_ray: the sensor coordinates (x, y) of the ray that
+   * passes through a world-space point. Returns false if the point is
+   * outside the field of view.
+   */
+  bool project(const Vector3D& p, Vector2D* xy) const;
+
+  /**
+   * Solid angle density of generate_ray's directions for (x, y) uniform over
+   * the sensor, at a world-space direction; zero outside the field of view.
+   * Over the cosine to the view axis it is also the importance the camera
+   * emits in that direction.
+   */
+  double direction_pdf(const Vector3D& dir) const;
+
   // Lens aperture and focal distance for depth of field effects.
   double lensRadius;
   double focalDistance;
@@ -0,0 +1,110 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace CGL {
+
+static const char checkpointMagic[8] = {'P', 'T', 'C', 'H', 'K', 'P', 'T', '5'};
+
+Checkpoint::Checkpoint() : w(0), h(0), bandRows(1), settings(0) {}
+
+void Checkpoint::reset(size_t width, size_t height, size_t band_rows, uint64_t settings) {
+  w = width;
+  h = height;
+  bandRows = std::max(band_rows, (size_t) 1);
+  this->settings = settings;
+  pixels.assign(w * h, Pixel());
+  std::vector<std::mutex>((h + bandRows - 1) / bandRows).swap(bandLocks);
+}
+
+void Checkpoint::capture(const PathTracer& pt, size_t x0, size_t y0, size_t x1, size_t y1) {
+  for (size_t band = y0 / bandRows; band * bandRows < y1; band++) {
+    std::lock_guard<std::mutex> lk(bandLocks[band]);
+    size_t band_end = std::min(y1, (band + 1) * bandRows);
+    for (size_t y = std::max(y0, band * bandRows); y < band_end; y++) {
+      for (size_t x = x0; x < x1; x++) {
+        size_t i = x + y * w;
+        Pixel& p = pixels[i];
+        p.radiance = pt.sampleBuffer.data[i];
+        p.albedo = pt.albedoBuffer.data[i];
+        p.normal = pt.normalBuffer.data[i];
+        p.depth = pt.depthBuffer[i];
+        p.illum_deviation = pt.illumDeviationBuffer[i];
+        p.count = pt.sampleCountBuffer[i];
+        p.primitive = pt.trackPrimitives ? pt.primitiveBuffer[i] : 0;
+      }
+    }
+  }
+}
+
+bool Checkpoint::save(const std::string& filename, double elapsed) {
+  Header header;
+  memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+  header.width = w;
+  header.height = h;
+  header.settings = settings;
+  header.elapsed = elapsed;
+
+  std::string temp = filename + ".tmp";
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (!file) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  std::vector<Pixel> copy;
+  for (size_t band = 0; ok && band < bandLocks.size(); band++) {
+    size_t begin = band * bandRows * w;
+    size_t end = std::min((band + 1) * bandRows, h) * w;
+    {
+      std::lock_guard<std::mutex> lk(bandLocks[band]);
+      copy.assign(pixels.begin() + begin, pixels.begin() + end);
+    }
+    ok = fwrite(copy.data(), sizeof(Pixel), copy.size(), file) == copy.size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Checkpoint::load(const std::string& filename, PathTracer* pt, double* elapsed) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (!file) return false;
+
+  Header header;
+  std::vector<Pixel> loaded(w * h);
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, checkpointMagic, sizeof(header.magic)) == 0 &&
+            header.width == w && header.height == h && header.settings == settings &&
+            fread(loaded.data(), sizeof(Pixel), loaded.size(), file) == loaded.size();
+  fclose(file);
+  if (!ok) {
+    fprintf(stderr, "[PathTracer] Ignoring checkpoint %s: it is not from a render of these settings\n",
+            filename.c_str());
+    return false;
+  }
+
+  pixels.swap(loaded);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    const Pixel& p = pixels[i];
+    pt->sampleBuffer.data[i] = p.radiance;
+    pt->albedoBuffer.data[i] = p.albedo;
+    pt->normalBuffer.data[i] = p.normal;
+    pt->depthBuffer[i] = p.depth;
+    pt->illumDeviationBuffer[i] = p.illum_deviation;
+    pt->sampleCountBuffer[i] = p.count;
+    if (pt->trackPrimitives) pt->primitiveBuffer[i] = p.primitive;
+  }
+  *elapsed = header.elapsed;
+  return true;
+}
+
+size_t Checkpoint::num_samples() const {
+  size_t total = 0;
+  for (const Pixel& p : pixels) total += p.count;
+  return total;
+}
+
+}  // namespace CGL
@@ -0,0 +1,98 @@
+#ifndef CGL_CHECKPOINT_H
+#define CGL_CHECKPOINT_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pathtracer/pathtracer.h"
+
+namespace CGL {
+
+/**
+ * Snapshot of a render's accumulated samples that can be saved to a file and
+ * loaded into a later render of the same frame.
+ *
+ * Render threads capture regions once they have finished a pass over them,
+ * so the snapshot only ever holds whole passes. Each band of rows has its
+ * own lock, and save() copies and writes one band at a time, so a save only
+ * holds up the threads capturing into the band being copied. Since every
+ * sample's random numbers follow from the pixel and the sample's index, a
+ * render resumed from the samples of a checkpoint continues exactly where
+ * the interrupted one was.
+ */
+class Checkpoint {
+ public:
+
+  Checkpoint();
+
+  /**
+   * Start an empty snapshot of a frame of the given size. Must not be
+   * called while the snapshot is being captured into or saved.
+   * \param band_rows rows locked together; regions captured never straddle
+   *                  bands, so a saved band holds whole passes
+   * \param settings hash of the scene, camera and render settings, which a
+   *                 loaded checkpoint must match
+   */
+  void reset(size_t width, size_t height, size_t band_rows, uint64_t settings);
+
+  /**
+   * Copy the path tracer's samples over [x0, x1) x [y0, y1) into the
+   * snapshot. The region must not be rendered to meanwhile.
+   */
+  void capture(const PathTracer& pt, size_t x0, size_t y0, size_t x1, size_t y1);
+
+  /**
+   * Write the snapshot to the file, via a temporary file so an interrupted
+   * write leaves the previous checkpoint in place.
+   * \param elapsed seconds the render has taken so far
+   */
+  bool save(const std::string& filename, double elapsed);
+
+  /**
+   * Load the file into the snapshot and the path tracer's buffers. Fails if
+   * there is no such file or it is from a render of another frame size or
+   * settings. Must not be called while the snapshot is being captured into
+   * or saved.
+   * \param elapsed address to store the seconds the render had taken
+   */
+  bool load(const std::string& filename, PathTracer* pt, double* elapsed);
+
+  /**
+   * Total samples in the snapshot.
+   */
+  size_t num_samples() const;
+
+ private:
+
+  /**
+   * What the path tracer accumulates for a pixel.
+   */
+  struct Pixel {
+    FloatRGB radiance;
+    HalfRGB albedo;
+    HalfRGB normal;
+    float depth;
+    float illum_deviation;
+    int32_t count;
+    uint32_t primitive;
+  };
+
+  struct Header {
+    char magic[8];
+    uint64_t width, height;
+    uint64_t settings;
+    double elapsed;
+  };
+
+  size_t w, h;
+  size_t bandRows;
+  uint64_t settings;
+  std::vector<Pixel> pixels;
+  std::vector<std::mutex> bandLocks;  ///< guard bandRows rows of pixels each
+};
+
+}  // namespace CGL
+
+#endif  // CGL_CHECKPOINT_H
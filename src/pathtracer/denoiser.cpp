@@ -0,0 +1,151 @@
+#include "denoiser.h"
+
+#include <cmath>
+#include <functional>
+#include <algorithm>
+
+namespace CGL {
+
+// B3-spline kernel, indexed by distance from the center tap.
+static const float kernel[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+static inline float luminance(float r, float g, float b) {
+  return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+Denoiser::Denoiser(ThreadPool* pool, size_t iterations)
+    : pool(pool),
+      numIterations(iterations) {
+  sigmaLuminance = 4.f;
+  sigmaNormal = 128.f;
+  sigmaDepth = 0.02f;
+  sigmaAlbedo = 0.1f;
+}
+
+void Denoiser::denoise(const PathTracer& pt, HDRImageBuffer& output,
+                       size_t x0, size_t y0, size_t x1, size_t y1) {
+  w = pt.sampleBuffer.w;
+  h = pt.sampleBuffer.h;
+  rx0 = x0; ry0 = y0;
+  rx1 = std::min(x1, w); ry1 = std::min(y1, h);
+
+  output.resize(w, h);
+  for (size_t i = 0; i < w * h; i++) output.data[i] = pt.sampleBuffer.data[i];
+  if (rx0 >= rx1 || ry0 >= ry1) return;
+
+  // Gather color, noise and guide features into float planes.
+  size_t n = w * h;
+  Planes cur, next;
+  cur.resize(n);
+  next.resize(n);
+  nx.resize(n); ny.resize(n); nz.resize(n);
+  ar.resize(n); ag.resize(n); ab.resize(n);
+  depth.resize(n);
+  for (size_t y = ry0; y < ry1; y++) {
+    for (size_t x = rx0; x < rx1; x++) {
+      size_t i = x + y * w;
+      const FloatRGB& c = pt.sampleBuffer.data[i];
+      cur.r[i] = c.r; cur.g[i] = c.g; cur.b[i] = c.b;
+      cur.var[i] = pt.pixel_variance(x, y);
+
+      // Normals averaged over a pixel straddling an edge are shorter than
+      // one; renormalize so the cosine test compares directions only.
+      Vector3D nrm = pt.normalBuffer.data[i];
+      double len = nrm.norm();
+      if (len > 0) nrm /= len;
+      nx[i] = nrm.x; ny[i] = nrm.y; nz[i] = nrm.z;
+
+      Vector3D a = pt.albedoBuffer.data[i];
+      ar[i] = a.x; ag[i] = a.y; ab[i] = a.z;
+      depth[i] = pt.depthBuffer[i];
+    }
+  }
+
+  // Each pass reads the previous pass's result in full, so rows are split
+  // into bands that are joined before the next pass starts.
+  for (size_t it = 0; it < numIterations; it++) {
+    int step = 1 << it;
+    HDRImageBuffer::for_rows(ry0, ry1, pool, [&](size_t row0, size_t row1, size_t t) {
+      filter_rows(cur, next, step, row0, row1);
+    });
+    std::swap(cur, next);
+  }
+
+  for (size_t y = ry0; y < ry1; y++) {
+    for (size_t x = rx0; x < rx1; x++) {
+      size_t i = x + y * w;
+      output.data[i] = Vector3D(cur.r[i], cur.g[i], cur.b[i]);
+    }
+  }
+}
+
+void Denoiser::filter_rows(const Planes& in, Planes& out, int step,
+                           size_t row0, size_t row1) const {
+  const int ix0 = rx0, iy0 = ry0, ix1 = rx1, iy1 = ry1;
+  const float inv_sigma_albedo2 = 1.f / (sigmaAlbedo * sigmaAlbedo);
+
+  for (int y = row0; y < (int)row1; y++) {
+    for (int x = ix0; x < ix1; x++) {
+      size_t p = x + y * w;
+
+      // The luminance edge stop scales with the noise at the pixel; a small
+      // blur of the variance keeps single outliers from dominating it.
+      float var_sum = 0, var_weight = 0;
+      for (int dy = -1; dy <= 1; dy++) {
+        int qy = y + dy;
+        if (qy < iy0 || qy >= iy1) continue;
+        for (int dx = -1; dx <= 1; dx++) {
+          int qx = x + dx;
+          if (qx < ix0 || qx >= ix1) continue;
+          float k = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+          var_sum += k * in.var[qx + qy * w];
+          var_weight += k;
+        }
+      }
+      float lum_scale = 1.f / (sigmaLuminance * sqrtf(var_sum / var_weight) + 1e-6f);
+
+      float lum_p = luminance(in.r[p], in.g[p], in.b[p]);
+      float depth_scale = 1.f / (sigmaDepth * depth[p] * step + 1e-6f);
+
+      float sum_w = 0, sum_r = 0, sum_g = 0, sum_b = 0, sum_var = 0;
+      for (int dy = -2; dy <= 2; dy++) {
+        int qy = y + dy * step;
+        if (qy < iy0 || qy >= iy1) continue;
+        for (int dx = -2; dx <= 2; dx++) {
+          int qx = x + dx * step;
+          if (qx < ix0 || qx >= ix1) continue;
+          size_t q = qx + qy * w;
+
+          float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+          if (q != p) {
+            float cos_n = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+            if (cos_n <= 0) continue;
+
+            float d_lum = fabsf(lum_p - luminance(in.r[q], in.g[q], in.b[q]));
+            float d_depth = fabsf(depth[p] - depth[q]) / sqrtf(float(dx * dx + dy * dy));
+            float d_albedo = (ar[p] - ar[q]) * (ar[p] - ar[q]) +
+                             (ag[p] - ag[q]) * (ag[p] - ag[q]) +
+                             (ab[p] - ab[q]) * (ab[p] - ab[q]);
+            weight *= powf(cos_n, sigmaNormal) *
+                      expf(-d_lum * lum_scale - d_depth * depth_scale -
+                           d_albedo * inv_sigma_albedo2);
+          }
+
+          sum_w += weight;
+          sum_r += weight * in.r[q];
+          sum_g += weight * in.g[q];
+          sum_b += weight * in.b[q];
+          sum_var += weight * weight * in.var[q];
+        }
+      }
+
+      // The center tap always contributes, so sum_w > 0.
+      out.r[p] = sum_r / sum_w;
+      out.g[p] = sum_g / sum_w;
+      out.b[p] = sum_b / sum_w;
+      out.var[p] = sum_var / (sum_w * sum_w);
+    }
+  }
+}
+
+}  // namespace CGL
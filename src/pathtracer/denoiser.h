@@ -0,0 +1,76 @@
+#ifndef CGL_DENOISER_H
+#define CGL_DENOISER_H
+
+#include <vector>
+
+#include "pathtracer/pathtracer.h"
+#include "util/image.h"
+
+namespace CGL {
+
+/**
+ * Edge-avoiding a-trous wavelet denoiser.
+ * Repeatedly blurs the path traced image with a 5x5 B3-spline kernel whose
+ * taps are spread 1, 2, 4, ... pixels apart, so a few iterations cover a wide
+ * footprint. Each tap is weighted down where the first-hit albedo, normal or
+ * depth differ from the center pixel, and where the luminance differs by more
+ * than the pixel's estimated noise, so geometric and texture edges survive
+ * while converged regions are left alone.
+ */
+class Denoiser {
+ public:
+
+  /**
+   * Creates a denoiser.
+   * \param pool threads filtering rows of the image (NULL for the calling thread only)
+   * \param iterations number of a-trous passes (footprint is 4 * 2^iterations pixels)
+   */
+  Denoiser(ThreadPool* pool = NULL, size_t iterations = 5);
+
+  /**
+   * Filter the pathtracer's accumulated image over [x0, x1) x [y0, y1) into
+   * output, which is resized to the pathtracer's frame. Pixels outside the
+   * region are copied through unfiltered.
+   */
+  void denoise(const PathTracer& pt, HDRImageBuffer& output,
+               size_t x0, size_t y0, size_t x1, size_t y1);
+
+  float sigmaLuminance;  ///< luminance edge stop, in standard deviations of the noise
+  float sigmaNormal;     ///< exponent on the cosine between normals
+  float sigmaDepth;      ///< relative depth change tolerated per pixel of distance
+  float sigmaAlbedo;     ///< albedo edge stop
+
+ private:
+
+  /**
+   * One channel per plane, so the filter walks contiguous floats.
+   */
+  struct Planes {
+    void resize(size_t n) {
+      r.resize(n); g.resize(n); b.resize(n); var.resize(n);
+    }
+    std::vector<float> r, g, b, var;
+  };
+
+  /**
+   * Run one a-trous pass with the given tap spacing over rows [row0, row1).
+   */
+  void filter_rows(const Planes& in, Planes& out, int step,
+                   size_t row0, size_t row1) const;
+
+  ThreadPool* pool;
+  size_t numIterations;
+
+  // Region being filtered //
+  size_t w, h;
+  size_t rx0, ry0, rx1, ry1;
+
+  // Guide features, fixed over all passes //
+  std::vector<float> nx, ny, nz;  ///< unit first-hit normal
+  std::vector<float> ar, ag, ab;  ///< first-hit albedo
+  std::vector<float> depth;       ///< first-hit depth
+};
+
+}  // namespace CGL
+
+#endif  // CGL_DENOISER_H
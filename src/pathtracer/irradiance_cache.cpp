@@ -0,0 +1,143 @@
+#include "irradiance_cache.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace CGL {
+
+IrradianceCache::Node::Node() {
+  for (int i = 0; i < 8; i++) child[i] = NULL;
+}
+
+IrradianceCache::Node::~Node() {
+  for (int i = 0; i < 8; i++) delete child[i].load();
+}
+
+IrradianceCache::IrradianceCache() : root(NULL) {
+  errorThreshold = 0;
+  rootSize = 0;
+  minRadius = maxRadius = 0;
+  maxDepth = 16;
+  numRecords = numLookups = numMisses = 0;
+}
+
+IrradianceCache::~IrradianceCache() {
+  delete root;
+}
+
+void IrradianceCache::reset(const BBox& bounds, double error) {
+  delete root;
+  root = new Node();
+
+  // A cubic root keeps octree cells cubic, so a cell's size bounds the
+  // influence radius of the records it holds in every direction.
+  rootSize = std::max(bounds.extent.x, std::max(bounds.extent.y, bounds.extent.z)) * 1.01;
+  rootMin = bounds.centroid() - Vector3D(rootSize / 2);
+
+  errorThreshold = error;
+  minRadius = rootSize * 0.002;
+  maxRadius = rootSize * 0.2;
+  numRecords = numLookups = numMisses = 0;
+}
+
+bool IrradianceCache::lookup(const Vector3D& p, const Vector3D& n, Vector3D* E) {
+  numLookups++;
+  Vector3D sum;
+  double weight = 0;
+  lookup(root, rootMin, rootSize, p, n, &sum, &weight);
+  if (weight <= 0) {
+    numMisses++;
+    return false;
+  }
+  *E = sum / weight;
+  E->r = std::max(E->r, 0.0);
+  E->g = std::max(E->g, 0.0);
+  E->b = std::max(E->b, 0.0);
+  return true;
+}
+
+void IrradianceCache::lookup(Node* node, const Vector3D& lo, double size,
+                             const Vector3D& p, const Vector3D& n,
+                             Vector3D* sum, double* weight) {
+  {
+    std::lock_guard<std::mutex> lk(node->lock);
+    for (const Record& rec : node->records) {
+      Vector3D d = p - rec.p;
+
+      // Records behind the point see a different environment.
+      if (dot(d, n + rec.n) < -0.01 * rec.R) continue;
+
+      double err = d.norm() / rec.R + sqrt(std::max(0.0, 1 - dot(n, rec.n)));
+      if (err >= errorThreshold) continue;
+      double w = 1 / std::max(err, 1e-6);
+
+      // First order extrapolation of the record's irradiance to the point.
+      Vector3D rot = cross(rec.n, n);
+      Vector3D E = rec.E + Vector3D(dot(rot, rec.gradR[0]) + dot(d, rec.gradT[0]),
+                                    dot(rot, rec.gradR[1]) + dot(d, rec.gradT[1]),
+                                    dot(rot, rec.gradR[2]) + dot(d, rec.gradT[2]));
+      *sum += w * E;
+      *weight += w;
+    }
+  }
+
+  // Records sit in a cell at most half its size wide around their position,
+  // so each child's bounds are loosened by half its size.
+  double half = size / 2;
+  for (int i = 0; i < 8; i++) {
+    Node* c = node->child[i].load();
+    if (!c) continue;
+    Vector3D clo = lo + Vector3D(i & 1 ? half : 0, i & 2 ? half : 0, i & 4 ? half : 0);
+    bool inside = true;
+    for (int axis = 0; axis < 3; axis++) {
+      if (p[axis] < clo[axis] - half / 2 || p[axis] > clo[axis] + half * 1.5) inside = false;
+    }
+    if (inside) lookup(c, clo, half, p, n, sum, weight);
+  }
+}
+
+void IrradianceCache::insert(Record record) {
+  // Besides the scene-relative limits, keep the radius below the distance
+  // over which the gradient predicts the irradiance to change completely.
+  Vector3D grad = 0.2126 * record.gradT[0] + 0.7152 * record.gradT[1] +
+                  0.0722 * record.gradT[2];
+  if (grad.norm() > 0) record.R = std::min(record.R, record.E.illum() / grad.norm());
+  record.R = std::max(minRadius, std::min(record.R, maxRadius));
+
+  // A record is used at most errorThreshold times its radius away, and goes
+  // in the smallest cell at least twice that size.
+  double influence = record.R * errorThreshold;
+  Node* node = root;
+  Vector3D lo = rootMin;
+  double size = rootSize;
+  for (int depth = 0; depth < maxDepth && size / 2 >= 2 * influence; depth++) {
+    double half = size / 2;
+    int i = 0;
+    Vector3D clo = lo;
+    for (int axis = 0; axis < 3; axis++) {
+      if (record.p[axis] >= lo[axis] + half) {
+        i |= 1 << axis;
+        clo[axis] += half;
+      }
+    }
+
+    Node* c = node->child[i].load();
+    if (!c) {
+      std::lock_guard<std::mutex> lk(node->lock);
+      c = node->child[i].load();
+      if (!c) {
+        c = new Node();
+        node->child[i] = c;
+      }
+    }
+    node = c;
+    lo = clo;
+    size = half;
+  }
+
+  std::lock_guard<std::mutex> lk(node->lock);
+  node->records.push_back(record);
+  numRecords++;
+}
+
+}  // namespace CGL
@@ -0,0 +1,93 @@
+#ifndef CGL_IRRADIANCE_CACHE_H
+#define CGL_IRRADIANCE_CACHE_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "CGL/vector3D.h"
+#include "scene/bbox.h"
+
+namespace CGL {
+
+/**
+ * Irradiance cache (Ward et al. 1988) with irradiance gradients (Ward and
+ * Heckbert 1992) for diffuse interreflection.
+ *
+ * Records of indirect irradiance are computed lazily wherever a lookup finds
+ * no record close enough, and interpolated everywhere else. A record's
+ * error estimate at a point grows with distance relative to the harmonic
+ * mean distance of the geometry the record saw, and with the change of
+ * normal; records are used where it stays below the error threshold, so
+ * smaller thresholds mean more records and less interpolation error.
+ *
+ * Records live in a loose octree shared by all render threads. Every node
+ * has its own lock, and nodes are never removed until reset().
+ */
+class IrradianceCache {
+ public:
+
+  struct Record {
+    Vector3D p;           ///< position
+    Vector3D n;           ///< surface normal
+    Vector3D E;           ///< indirect irradiance
+    double R;             ///< harmonic mean distance to the surrounding geometry
+    Vector3D gradR[3];    ///< rotational gradient of each color channel of E
+    Vector3D gradT[3];    ///< translational gradient of each color channel of E
+  };
+
+  IrradianceCache();
+  ~IrradianceCache();
+
+  /**
+   * Drop all records and cover the given scene bounds.
+   * \param bounds scene bounds
+   * \param error error threshold; typical values are 0.1 to 0.4
+   */
+  void reset(const BBox& bounds, double error);
+
+  /**
+   * Interpolate the irradiance at a point from the records around it.
+   * \return false if no record is close enough
+   */
+  bool lookup(const Vector3D& p, const Vector3D& n, Vector3D* E);
+
+  /**
+   * Add a record. Its radius is clamped to the cache's limits first.
+   */
+  void insert(Record record);
+
+  size_t num_records() const { return numRecords; }
+  size_t num_lookups() const { return numLookups; }
+  size_t num_misses() const { return numMisses; }
+
+ private:
+
+  struct Node {
+    Node();
+    ~Node();
+    std::atomic<Node*> child[8];
+    std::vector<Record> records;
+    std::mutex lock;
+  };
+
+  void lookup(Node* node, const Vector3D& lo, double size,
+              const Vector3D& p, const Vector3D& n,
+              Vector3D* sum, double* weight);
+
+  Node* root;
+  Vector3D rootMin;   ///< lower corner of the cubic root node
+  double rootSize;    ///< side length of the root node
+
+  double errorThreshold;
+  double minRadius, maxRadius;  ///< limits on record radii, from the scene size
+  int maxDepth;
+
+  std::atomic<size_t> numRecords;
+  std::atomic<size_t> numLookups;
+  std::atomic<size_t> numMisses;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_IRRADIANCE_CACHE_H
@@ -0,0 +1,280 @@
+#include "path_guide.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "CGL/CGL.h"
+#include "util/random_util.h"
+
+namespace CGL {
+
+static Vector2D dir_to_square(const Vector3D& w) {
+  double cos_theta = std::max(-1.0, std::min(w.z, 1.0));
+  double phi = atan2(w.y, w.x);
+  if (phi < 0) phi += 2 * PI;
+  return Vector2D((cos_theta + 1) / 2, phi / (2 * PI));
+}
+
+static Vector3D square_to_dir(const Vector2D& p) {
+  double cos_theta = 2 * p.x - 1;
+  double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+  double phi = 2 * PI * p.y;
+  return Vector3D(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+}
+
+static inline int quadrant(const Vector2D& p) {
+  return (p.x >= 0.5 ? 1 : 0) + (p.y >= 0.5 ? 2 : 0);
+}
+
+// Directional quadtree //
+
+DTree::Node::Node() {
+  for (int i = 0; i < 4; i++) {
+    sum[i] = 0;
+    child[i] = 0;
+  }
+}
+
+DTree::DTree() : records(0), nodes(1) { }
+
+void DTree::record(Vector2D p, float value) {
+  records++;
+  int n = 0;
+  while (true) {
+    int q = quadrant(p);
+    nodes[n].sum[q] += value;
+    if (nodes[n].child[q] == 0) return;
+    p = 2 * p - Vector2D(q & 1, q >> 1);
+    n = nodes[n].child[q];
+  }
+}
+
+Vector2D DTree::sample() const {
+  Vector2D origin(0, 0);
+  double size = 1;
+  int n = 0;
+  while (true) {
+    const Node& node = nodes[n];
+    float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+    if (total <= 0) break;
+
+    float u = random_uniform() * total;
+    int q = 0;
+    while (q < 3 && u >= node.sum[q]) u -= node.sum[q++];
+
+    size /= 2;
+    origin += size * Vector2D(q & 1, q >> 1);
+    if (node.child[q] == 0) break;
+    n = node.child[q];
+  }
+  return origin + size * Vector2D(random_uniform(), random_uniform());
+}
+
+double DTree::pdf(Vector2D p) const {
+  double pdf = 1;
+  int n = 0;
+  while (true) {
+    const Node& node = nodes[n];
+    float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+    if (total <= 0) return pdf;
+
+    int q = quadrant(p);
+    pdf *= 4 * node.sum[q] / total;
+    if (node.child[q] == 0) return pdf;
+    p = 2 * p - Vector2D(q & 1, q >> 1);
+    n = node.child[q];
+  }
+}
+
+DTree DTree::refined(float threshold, int max_depth) const {
+  const Node& root = nodes[0];
+  float total = root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+  if (total <= 0) return DTree();
+
+  float fraction[4];
+  for (int q = 0; q < 4; q++) fraction[q] = root.sum[q] / total;
+
+  DTree out;
+  out.nodes.clear();
+  build(out, 0, fraction, threshold, 1, max_depth);
+  return out;
+}
+
+int DTree::build(DTree& out, int old_node, const float fraction[4],
+                 float threshold, int depth, int max_depth) const {
+  int idx = out.nodes.size();
+  out.nodes.push_back(Node());
+
+  for (int q = 0; q < 4; q++) {
+    if (fraction[q] <= threshold || depth >= max_depth) continue;
+
+    // Split the quadrant's energy among its children as this tree saw it,
+    // or evenly where this tree had not subdivided yet.
+    float sub[4];
+    int old_child = old_node >= 0 ? nodes[old_node].child[q] : 0;
+    float child_total = 0;
+    if (old_child) {
+      const Node& c = nodes[old_child];
+      child_total = c.sum[0] + c.sum[1] + c.sum[2] + c.sum[3];
+    }
+    for (int i = 0; i < 4; i++) {
+      sub[i] = child_total > 0 ? fraction[q] * nodes[old_child].sum[i] / child_total
+                               : fraction[q] / 4;
+    }
+
+    int child = build(out, old_child ? old_child : -1, sub, threshold, depth + 1, max_depth);
+    out.nodes[idx].child[q] = child;
+  }
+  return idx;
+}
+
+// Spatial-directional tree //
+
+PathGuide::PathGuide() : current(NULL) {
+  recordsSinceAdvance = 0;
+  generationLength = 0;
+  generationCount = 0;
+
+  initialGenerationLength = 1 << 16;
+  maxGenerations = 12;
+  splitFactor = 16;
+  quadtreeThreshold = 0.01f;
+  quadtreeMaxDepth = 20;
+}
+
+PathGuide::~PathGuide() {
+  delete current.load();
+  for (Generation* g : retired) delete g;
+}
+
+void PathGuide::reset(const BBox& bounds) {
+  std::lock_guard<std::mutex> lk(advanceLock);
+  delete current.load();
+  for (Generation* g : retired) delete g;
+  retired.clear();
+
+  Generation* g = new Generation();
+  g->bounds = bounds;
+  g->nodes.push_back(SNode());
+  g->nodes[0].axis = 0;
+  g->nodes[0].child[0] = g->nodes[0].child[1] = 0;
+  g->nodes[0].region = 0;
+  g->regions.push_back(std::unique_ptr<Region>(new Region()));
+  current = g;
+
+  recordsSinceAdvance = 0;
+  generationLength = initialGenerationLength;
+  generationCount = 0;
+}
+
+PathGuide::Region* PathGuide::find(const Vector3D& p) const {
+  const Generation* g = current.load();
+  Vector3D lo = g->bounds.min, hi = g->bounds.max;
+  int n = 0;
+  while (g->nodes[n].child[0]) {
+    const SNode& node = g->nodes[n];
+    double mid = (lo[node.axis] + hi[node.axis]) / 2;
+    if (p[node.axis] < mid) {
+      hi[node.axis] = mid;
+      n = node.child[0];
+    } else {
+      lo[node.axis] = mid;
+      n = node.child[1];
+    }
+  }
+  return g->regions[g->nodes[n].region].get();
+}
+
+Vector3D PathGuide::sample(const Region* region) const {
+  return square_to_dir(region->sampling.sample());
+}
+
+double PathGuide::pdf(const Region* region, const Vector3D& w) const {
+  // The cylindrical mapping preserves area, so the density on the sphere is
+  // the density on the square over the sphere's area.
+  return region->sampling.pdf(dir_to_square(w)) / (4 * PI);
+}
+
+void PathGuide::record(Region* region, const Vector3D& w, double value) {
+  if (!std::isfinite(value) || value < 0) return;
+  {
+    std::lock_guard<std::mutex> lk(region->lock);
+    region->building.record(dir_to_square(w), value);
+  }
+
+  // Whoever completes a generation builds the next one; anybody arriving
+  // while that happens just keeps recording.
+  size_t n = ++recordsSinceAdvance;
+  if (n >= generationLength && generationCount < maxGenerations &&
+      advanceLock.try_lock()) {
+    if (recordsSinceAdvance >= generationLength) advance();
+    advanceLock.unlock();
+  }
+}
+
+size_t PathGuide::generations() const {
+  return generationCount;
+}
+
+void PathGuide::advance() {
+  Generation* from = current.load();
+  Generation* next = new Generation();
+  next->bounds = from->bounds;
+  rebuild(*from, 0, 0, *next);
+
+  current = next;
+  retired.push_back(from);
+  generationCount++;
+  generationLength = generationLength * 2;
+  recordsSinceAdvance = 0;
+}
+
+int PathGuide::rebuild(const Generation& from, int node, int depth,
+                       Generation& next) const {
+  const SNode& old = from.nodes[node];
+  if (old.child[0] == 0) {
+    Region& region = *from.regions[old.region];
+    DTree learned;
+    {
+      std::lock_guard<std::mutex> lk(region.lock);
+      learned = region.building;
+    }
+    return split(next, learned, depth, learned.records);
+  }
+
+  int idx = next.nodes.size();
+  next.nodes.push_back(old);
+  int lower = rebuild(from, old.child[0], depth + 1, next);
+  int upper = rebuild(from, old.child[1], depth + 1, next);
+  next.nodes[idx].child[0] = lower;
+  next.nodes[idx].child[1] = upper;
+  return idx;
+}
+
+int PathGuide::split(Generation& next, const DTree& learned, int depth,
+                     size_t records) const {
+  int idx = next.nodes.size();
+  next.nodes.push_back(SNode());
+  next.nodes[idx].axis = depth % 3;
+  next.nodes[idx].child[0] = next.nodes[idx].child[1] = 0;
+
+  // Busy regions are halved until each half would have seen few enough
+  // records; both halves start from the parent's distribution.
+  double threshold = splitFactor * sqrt((double) generationLength);
+  if (records > threshold) {
+    int lower = split(next, learned, depth + 1, records / 2);
+    int upper = split(next, learned, depth + 1, records / 2);
+    next.nodes[idx].child[0] = lower;
+    next.nodes[idx].child[1] = upper;
+    return idx;
+  }
+
+  Region* region = new Region();
+  region->sampling = learned;
+  region->building = learned.refined(quadtreeThreshold, quadtreeMaxDepth);
+  next.nodes[idx].region = next.regions.size();
+  next.regions.push_back(std::unique_ptr<Region>(region));
+  return idx;
+}
+
+}  // namespace CGL
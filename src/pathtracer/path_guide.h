@@ -0,0 +1,161 @@
+#ifndef CGL_PATH_GUIDE_H
+#define CGL_PATH_GUIDE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CGL/vector2D.h"
+#include "CGL/vector3D.h"
+#include "scene/bbox.h"
+
+namespace CGL {
+
+/**
+ * Directional quadtree over the unit square, which maps to the sphere of
+ * directions by the area-preserving cylindrical mapping
+ * (cos theta, phi) -> ((cos theta + 1) / 2, phi / 2pi).
+ * Every node stores the energy recorded in each of its four quadrants;
+ * sampling descends by energy and is uniform inside the leaf quadrant.
+ */
+class DTree {
+ public:
+
+  DTree();
+
+  /**
+   * Add energy at a point of the unit square. Not thread-safe.
+   */
+  void record(Vector2D p, float value);
+
+  /**
+   * Sample a point of the unit square proportionally to the recorded energy.
+   * An empty tree samples uniformly.
+   */
+  Vector2D sample() const;
+
+  /**
+   * Density of sample() at a point of the unit square.
+   */
+  double pdf(Vector2D p) const;
+
+  /**
+   * Empty tree whose quadrants are subdivided where this tree holds more than
+   * the given fraction of its total energy, and merged elsewhere.
+   */
+  DTree refined(float threshold, int max_depth) const;
+
+  size_t records;  ///< number of record() calls since the tree was built
+
+ private:
+
+  struct Node {
+    Node();
+    float sum[4];   ///< energy per quadrant (x-major: 0 = low x low y, 1 = high x)
+    int child[4];   ///< child node per quadrant, 0 if the quadrant is a leaf
+  };
+
+  int build(DTree& out, int old_node, const float fraction[4],
+            float threshold, int depth, int max_depth) const;
+
+  std::vector<Node> nodes;
+};
+
+/**
+ * Online path guiding with a spatial-directional tree (SD-tree) in the
+ * spirit of Mueller et al. 2017: a kd-tree over the scene whose leaves hold a
+ * pair of directional quadtrees of incident radiance, one being learned from
+ * completed bounces and one, learned previously, that is sampled.
+ *
+ * Training runs in generations of doubling length. When a generation has
+ * recorded enough bounces, one thread builds the next generation (splitting
+ * busy spatial leaves and refining the quadtrees) and publishes it
+ * atomically; other threads keep rendering against whichever generation
+ * they looked up. Old generations stay alive until reset(), so regions
+ * handed out by find() remain valid for the whole render.
+ */
+class PathGuide {
+ public:
+
+  /**
+   * Spatial leaf of the SD-tree.
+   */
+  struct Region {
+    DTree sampling;   ///< learned distribution, read-only
+    DTree building;   ///< distribution being learned, guarded by lock
+    std::mutex lock;
+  };
+
+  PathGuide();
+  ~PathGuide();
+
+  /**
+   * Forget everything learned and cover the given scene bounds with a single
+   * untrained region.
+   */
+  void reset(const BBox& bounds);
+
+  /**
+   * Region of the current generation containing the point.
+   */
+  Region* find(const Vector3D& p) const;
+
+  /**
+   * Sample a world-space direction from the region's learned distribution.
+   */
+  Vector3D sample(const Region* region) const;
+
+  /**
+   * Solid angle density of sample() for a world-space direction.
+   */
+  double pdf(const Region* region, const Vector3D& w) const;
+
+  /**
+   * Record a Monte Carlo estimate of incident radiance (radiance over the
+   * density the direction was sampled with) for a world-space direction.
+   * Thread-safe; may advance the guide to its next generation.
+   */
+  void record(Region* region, const Vector3D& w, double value);
+
+  /**
+   * Number of generations trained since the last reset.
+   */
+  size_t generations() const;
+
+ private:
+
+  struct SNode {
+    int axis;       ///< split axis of an inner node
+    int child[2];   ///< lower and upper half, 0 for a leaf
+    int region;     ///< index into Generation::regions for a leaf
+  };
+
+  struct Generation {
+    BBox bounds;
+    std::vector<SNode> nodes;
+    std::vector<std::unique_ptr<Region>> regions;
+  };
+
+  void advance();
+  int rebuild(const Generation& from, int node, int depth, Generation& next) const;
+  int split(Generation& next, const DTree& learned, int depth, size_t records) const;
+
+  std::atomic<Generation*> current;
+  std::vector<Generation*> retired;   ///< earlier generations, freed on reset
+  std::mutex advanceLock;
+
+  std::atomic<size_t> recordsSinceAdvance;
+  std::atomic<size_t> generationLength;   ///< records that end the current generation
+  std::atomic<size_t> generationCount;
+
+  size_t initialGenerationLength;  ///< records in the first generation
+  size_t maxGenerations;           ///< training stops after this many
+  double splitFactor;              ///< leaves split beyond splitFactor * sqrt(generation length) records
+  float quadtreeThreshold;         ///< energy fraction that subdivides a quadrant
+  int quadtreeMaxDepth;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_PATH_GUIDE_H
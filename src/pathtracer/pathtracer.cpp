@@ -13,6 +13,20 @@ PathTracer::PathTracer() {
   gridSampler = new UniformGridSampler2D();
   hemisphereSampler = new UniformHemisphereSampler3D();
 
+  pathGuide = NULL;
+  guideFraction = 0.5;
+
+  irradianceCache = NULL;
+  ns_irradiance = 256;
+
+  gatherCaustics = false;
+  bdpt = NULL;
+  sampleSequence = SEQUENCE_RANDOM;
+  seed = 0;
+  bandStart = 0;
+  imageHeight = 0;
+  trackPrimitives = false;
+
   tm_gamma = 2.2f;
   tm_level = 1.0f;
   tm_key = 0.18;
@@ -27,6 +41,17 @@ PathTracer::~PathTracer() {
 void PathTracer::set_frame_size(size_t width, size_t height) {
   sampleBuffer.resize(width, height);
   sampleCountBuffer.resize(width * height);
+  illumDeviationBuffer.resize(width * height);
+  albedoBuffer.resize(width, height);
+  normalBuffer.resize(width, height);
+  depthBuffer.resize(width * height);
+  primitiveBuffer.resize(trackPrimitives ? width * height : 0);
+  colorEncoder = ColorEncoder(tm_gamma, tm_level);
+}
+
+void PathTracer::set_band(size_t y0, size_t image_height) {
+  bandStart = y0;
+  imageHeight = image_height;
 }
 
 void PathTracer::clear() {
@@ -35,13 +60,19 @@ void PathTracer::clear() {
   camera = NULL;
   sampleBuffer.clear();
   sampleCountBuffer.clear();
+  illumDeviationBuffer.clear();
+  albedoBuffer.resize(0, 0);
+  normalBuffer.resize(0, 0);
+  depthBuffer.clear();
+  primitiveBuffer.clear();
   sampleBuffer.resize(0, 0);
   sampleCountBuffer.resize(0, 0);
 }
 
 void PathTracer::write_to_framebuffer(ImageBuffer &framebuffer, size_t x0,
-                                      size_t y0, size_t x1, size_t y1) {
-  sampleBuffer.toColor(framebuffer, x0, y0, x1, y1);
+                                      size_t y0, size_t x1, size_t y1,
+                                      ThreadPool* pool) {
+  sampleBuffer.toColor(framebuffer, colorEncoder, x0, y0, x1, y1, pool);
 }
 
 Vector3D
@@ -148,6 +179,10 @@ Vector3D PathTracer::one_bounce_radiance(const Ray &r,
 
 Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
                                                   const Intersection &isect) {
+  return one_bounce_radiance(r, isect) + bounce_radiance(r, isect);
+}
+
+Vector3D PathTracer::bounce_radiance(const Ray &r, const Intersection &isect) {
   Matrix3x3 o2w;
   make_coord_space(o2w, isect.n);
   Matrix3x3 w2o = o2w.T();
@@ -157,23 +192,206 @@ Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
 
   double pdf, p=0.7;
   Vector3D L_out, w_in;
-  Vector3D f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+  Vector3D f;
+
+  // With path guiding, pick the bounce from either the learned incident
+  // radiance or the BSDF, and weight it by the combined density (one-sample
+  // MIS), so directions either strategy can produce stay covered.
+  PathGuide::Region* region = NULL;
+  if (pathGuide && !isect.bsdf->is_delta()) {
+    region = pathGuide->find(hit_p);
+    if (coin_flip(guideFraction)) {
+      w_in = w2o * pathGuide->sample(region);
+      f = isect.bsdf->f(w_out, w_in);
+    } else {
+      f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+    }
+    pdf = guideFraction * pathGuide->pdf(region, o2w * w_in) +
+          (1 - guideFraction) * isect.bsdf->pdf(w_out, w_in);
+  } else {
+    f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+  }
 
-  L_out = one_bounce_radiance(r, isect);
-  if(max_ray_depth > 1 && (coin_flip(p) || r.depth == max_ray_depth)) {
+  // Glass transmits through the back of the shading frame.
+  double cos_in = isect.bsdf->is_delta() ? abs_cos_theta(w_in) : cos_theta(w_in);
+  if(max_ray_depth > 1 && cos_in > 0 && pdf > 0 &&
+     (coin_flip(p) || r.depth == max_ray_depth)) {
     Ray bounce = Ray(hit_p, o2w*w_in, (int)r.depth-1);
     bounce.min_t = EPS_D;
     Intersection bounceIsect;
+    Vector3D bounceSample;
     if (bvh->intersect(bounce, &bounceIsect)){
-      Vector3D bounceSample = at_least_one_bounce_radiance(bounce, bounceIsect);
-      L_out += bounceSample * f * cos_theta(w_in) / (pdf / p);
+      bounceSample = at_least_one_bounce_radiance(bounce, bounceIsect);
+      L_out += bounceSample * f * cos_in / (pdf / p);
 
     }
+    if (region) pathGuide->record(region, bounce.d, bounceSample.illum() / pdf);
   }
   return L_out;
 }
 
-Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
+Vector3D PathTracer::cached_irradiance(const Vector3D &p, const Vector3D &n,
+                                       int depth) {
+  Vector3D E;
+  if (irradianceCache->lookup(p, n, &E)) return E;
+
+  // Trace a new record over a stratified cosine-weighted hemisphere: M strata
+  // in theta and N = pi M in phi, the layout Ward and Heckbert's gradient
+  // estimates are built on. Sample (j, k) is stored at j + k * M.
+  int M = std::max(2, (int) round(sqrt(ns_irradiance / PI)));
+  int N = std::max(3, (int) round(PI * M));
+  std::vector<Vector3D> L(M * N);
+  std::vector<double> dist(M * N, INF_D);
+
+  Matrix3x3 o2w;
+  make_coord_space(o2w, n);
+
+  IrradianceCache::Record rec;
+  rec.p = p;
+  rec.n = n;
+  double inv_dist_sum = 0;
+  for (int k = 0; k < N; k++) {
+    for (int j = 0; j < M; j++) {
+      double sin_theta = sqrt((j + random_uniform()) / M);
+      double cos_theta = sqrt(1 - sin_theta * sin_theta);
+      double phi = 2 * PI * (k + random_uniform()) / N;
+      Vector3D w_in(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+
+      Ray ray(p, o2w * w_in, depth - 1);
+      ray.min_t = EPS_D;
+      Intersection hit;
+      Vector3D sample;
+      if (bvh->intersect(ray, &hit)) {
+        sample = at_least_one_bounce_radiance(ray, hit);
+        dist[j + k * M] = hit.t;
+        inv_dist_sum += 1 / hit.t;
+      }
+      L[j + k * M] = sample;
+      rec.E += sample;
+
+      // Rotational gradient: tilting the normal towards phi + pi/2 trades
+      // cosine weight between the two halves of the hemisphere.
+      Vector3D v = o2w * Vector3D(-sin(phi), cos(phi), 0);
+      for (int c = 0; c < 3; c++) {
+        rec.gradR[c] += v * (-sin_theta / cos_theta * sample[c]);
+      }
+    }
+  }
+  rec.E *= PI / (M * N);
+  for (int c = 0; c < 3; c++) rec.gradR[c] *= PI / (M * N);
+  rec.R = inv_dist_sum > 0 ? M * N / inv_dist_sum : INF_D;
+
+  // Translational gradient: moving the point shifts the radiance seen across
+  // each boundary between strata, in proportion to the cosine-weighted
+  // measure of the boundary over the distance to what lies behind it.
+  for (int k = 0; k < N; k++) {
+    double phi = 2 * PI * (k + 0.5) / N;
+    double phi_edge = 2 * PI * k / N;
+    Vector3D u = o2w * Vector3D(cos(phi), sin(phi), 0);
+    Vector3D v = o2w * Vector3D(-sin(phi_edge), cos(phi_edge), 0);
+    int prev_k = (k + N - 1) % N;
+
+    for (int j = 0; j < M; j++) {
+      Vector3D dL;
+      if (j > 0) {
+        double sin2 = (double) j / M;
+        double coef = 2 * PI / N * sqrt(sin2) * (1 - sin2) /
+                      std::min(dist[j + k * M], dist[j - 1 + k * M]);
+        dL = L[j + k * M] - L[j - 1 + k * M];
+        for (int c = 0; c < 3; c++) rec.gradT[c] += u * (coef * dL[c]);
+      }
+
+      double coef = (sqrt((j + 1.0) / M) - sqrt((double) j / M)) /
+                    std::min(dist[j + k * M], dist[j + prev_k * M]);
+      dL = L[j + k * M] - L[j + prev_k * M];
+      for (int c = 0; c < 3; c++) rec.gradT[c] += v * (coef * dL[c]);
+    }
+  }
+
+  irradianceCache->insert(rec);
+  return rec.E;
+}
+
+size_t PathTracer::trace_caustic_photons(size_t count, std::vector<Photon> *out) {
+  const std::vector<SceneLight*>& lights = scene->lights;
+  if (lights.empty() || count == 0) return 0;
+
+  // Most photons never touch a mirror or glass; give up on scenes where
+  // fewer than one in maxEmitRatio does.
+  const size_t maxEmitRatio = 64;
+  size_t emitted = 0;
+  while (out->size() < count && emitted < count * maxEmitRatio) {
+    size_t index = std::min((size_t) (random_uniform() * lights.size()), lights.size() - 1);
+    Vector3D o, d;
+    Vector3D power = lights[index]->sample_photon(&o, &d) * lights.size();
+    emitted++;
+    if (power.illum() <= 0) continue;
+
+    Ray ray(o, d);
+    ray.min_t = EPS_D;
+    bool specular = false;
+    for (size_t depth = 0; depth < max_ray_depth; depth++) {
+      Intersection isect;
+      if (!bvh->intersect(ray, &isect)) break;
+      Vector3D hit_p = ray.o + ray.d * isect.t;
+      if (depth == 0) power *= lights[index]->photon_arrival((hit_p - o).norm());
+
+      // Light reaching non-delta surfaces directly is what one_bounce_radiance
+      // estimates; only light focused by mirrors and glass is stored.
+      if (!isect.bsdf->is_delta()) {
+        if (specular) out->push_back(Photon(hit_p, power, -ray.d));
+        break;
+      }
+
+      Matrix3x3 o2w;
+      make_coord_space(o2w, isect.n);
+      Vector3D w_in;
+      double pdf;
+      Vector3D f = isect.bsdf->sample_f(o2w.T() * (-ray.d), &w_in, &pdf);
+      if (pdf <= 0) break;
+
+      // Russian roulette on the throughput keeps photon powers even.
+      Vector3D throughput = f * abs_cos_theta(w_in) / pdf;
+      double survive = std::min(1.0, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+      if (!coin_flip(survive)) break;
+      power = power * throughput / survive;
+
+      specular = true;
+      ray = Ray(hit_p, o2w * w_in);
+      ray.min_t = EPS_D;
+    }
+  }
+  return emitted;
+}
+
+Vector3D PathTracer::caustic_radiance(const Ray &r, const Intersection &isect) {
+  // The map may be replaced mid-gather; holding a reference keeps it alive.
+  std::shared_ptr<const PhotonMap> map = std::atomic_load(&causticMap);
+  if (!map || map->emitted() == 0) return Vector3D();
+
+  Matrix3x3 o2w;
+  make_coord_space(o2w, isect.n);
+  Matrix3x3 w2o = o2w.T();
+  Vector3D hit_p = r.o + r.d * isect.t;
+  Vector3D w_out = w2o * (-r.d);
+
+  std::vector<const Photon*> photons;
+  double r2;
+  map->gather(hit_p, &photons, &r2);
+
+  // Photon power over the disc the photons were found in; photons arriving
+  // from behind the surface belong to whatever is on the other side.
+  Vector3D L_out;
+  for (const Photon* photon : photons) {
+    Vector3D w_in = w2o * photon->direction();
+    if (w_in.z <= 0) continue;
+    L_out += isect.bsdf->f(w_out, w_in) * photon->flux();
+  }
+  return L_out / (PI * r2 * map->emitted());
+}
+
+Vector3D PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      Intersection *first_hit) {
   Intersection isect;
   Vector3D L_out;
 
@@ -190,47 +408,181 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   if (!bvh->intersect(r, &isect))
     return envLight ? envLight->sample_dir(r) : L_out;
 
+  if (first_hit) *first_hit = isect;
+
 
   L_out = (isect.t == INF_D) ? debug_shading(r.d) : normal_shading(isect.n);
   if (max_ray_depth == 0)
       return zero_bounce_radiance(r, isect);
-  return zero_bounce_radiance(r, isect) + at_least_one_bounce_radiance(r, isect);
+
+  return zero_bounce_radiance(r, isect) + camera_path_radiance(r, isect, 1);
+}
+
+Vector3D PathTracer::camera_path_radiance(const Ray &r, const Intersection &isect,
+                                          size_t bounces) {
+  Vector3D hit_p = r.o + r.d * isect.t;
+  Vector3D L_out;
+
+  // Follow mirrors and glass from the camera, picking up what is seen in
+  // them. Lights reached through them after a non-delta bounce are
+  // caustics, which come from the photon map instead.
+  if (isect.bsdf->is_delta() && bounces < max_ray_depth) {
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Vector3D w_out = o2w.T() * (-r.d);
+
+    // Glass hit by the camera ray splits into several reflected and
+    // transmitted paths, which share the camera ray's cost.
+    size_t n = bounces == 1 ? split_count(isect.bsdf) : 1;
+    for (size_t i = 0; i < n; i++) {
+      Vector3D w_in;
+      double pdf;
+      Vector3D f = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+      if (pdf <= 0) continue;
+      Vector3D throughput = f * abs_cos_theta(w_in) / pdf;
+
+      Ray next(hit_p, o2w * w_in, (int) r.depth);
+      next.min_t = EPS_D;
+      Intersection nextIsect;
+      if (!bvh->intersect(next, &nextIsect)) {
+        if (envLight) L_out += throughput * envLight->sample_dir(next);
+        continue;
+      }
+      L_out += throughput * (zero_bounce_radiance(next, nextIsect) +
+                             camera_path_radiance(next, nextIsect, bounces + 1));
+    }
+    return L_out / n;
+  }
+
+  // Caustics are gathered where the camera sees them directly or through
+  // mirrors and glass; a gather at every bounce would cost far more than the
+  // little caustic light that reaches the camera by diffuse interreflection.
+  if (gatherCaustics && !isect.bsdf->is_delta())
+    L_out += caustic_radiance(r, isect);
+
+  // Indirect light varies slowly over diffuse surfaces, so at camera hits it
+  // can come from the irradiance cache instead of a traced path.
+  if (irradianceCache && max_ray_depth > 1) {
+    DiffuseBSDF* diffuse = dynamic_cast<DiffuseBSDF*>(isect.bsdf);
+    if (diffuse) {
+      return L_out + one_bounce_radiance(r, isect) +
+             diffuse->get_albedo() / PI * cached_irradiance(hit_p, isect.n, r.depth);
+    }
+  }
+
+  // Split the first non-delta bounce: direct lighting is estimated once and
+  // the indirect light averaged over several bounces.
+  size_t n = isect.bsdf->is_delta() ? 1 : split_count(isect.bsdf);
+  Vector3D indirect;
+  for (size_t i = 0; i < n; i++) indirect += bounce_radiance(r, isect);
+  return L_out + one_bounce_radiance(r, isect) + indirect / n;
 }
 
-void PathTracer::raytrace_pixel(size_t x, size_t y) {
-  // TODO (Part 5):
-  // Modify your implementation to include adaptive sampling.
-  // Use the command line parameters "samplesPerBatch" and "maxTolerance"
+size_t PathTracer::split_count(const BSDF* bsdf) const {
+  size_t n = 1;
+  if (dynamic_cast<const DiffuseBSDF*>(bsdf)) {
+    n = ns_diff;
+  } else if (dynamic_cast<const MicrofacetBSDF*>(bsdf)) {
+    n = ns_glsy;
+  } else if (dynamic_cast<const GlassBSDF*>(bsdf) ||
+             dynamic_cast<const RefractionBSDF*>(bsdf)) {
+    n = ns_refr;
+  }
+  return std::max(n, (size_t) 1);
+}
 
-  int num_samples = ns_aa;          // total samples to evaluate
-  Vector2D origin = Vector2D(x, y); // bottom left corner of the pixel
+void PathTracer::raytrace_pixel(size_t x, size_t y, size_t num_samples,
+                                size_t thread) {
+  // A band of a taller image samples and seeds its pixels by their rows
+  // in the image, so it renders them exactly as the whole image would.
+  size_t image_y = y + bandStart;
+  size_t image_h = imageHeight ? imageHeight : sampleBuffer.h;
+  Vector2D origin = Vector2D(x, image_y); // bottom left corner of the pixel
   Vector3D estRadiance = Vector3D(.0, .0, .0);
+  double illumSum = 0, illumSquared = 0;
+  Vector3D albedo, normal;
+  double depth = 0;
+
+  // Progressive passes continue the pixel's sequence where the last one
+  // left off. The random numbers of a sample depend only on the seed, the
+  // pixel and the sample's index, not on the thread that happens to trace it.
+  size_t index = x + y * sampleBuffer.w;
+  size_t image_index = x + image_y * sampleBuffer.w;
+  for (size_t i = 0; i < num_samples; i++) {
+      uint64_t sample_index = sampleCountBuffer[index] + i;
+      seed_random(sample_index | (uint64_t) seed << 32, image_index);
+      start_pixel_sample(sampleSequence, x, image_y, sample_index, seed);
 
-  float illum, illum2, mean, variance, sd;
-  for (int i=0; i < num_samples; i++) {
       // get random pixel sample and normalize by image dimensions
       Vector2D pixelSample = origin + gridSampler->get_sample();
       pixelSample.x /= sampleBuffer.w;
-      pixelSample.y /= sampleBuffer.h;
+      pixelSample.y /= image_h;
       // generate ray and estimate illumination, update total est radiance
       Ray sampleRay = camera->generate_ray(pixelSample.x, pixelSample.y);
-      estRadiance += PathTracer::est_radiance_global_illumination(sampleRay);
-
-      illum += estRadiance.illum();
-      illumSquared += pow(estRadiance.illum(), 2);
-      if (i % samplesPerBatch == 1) {
-          mean = illum / (i + 1);
-          variance = (illumSquared - (illum * illum / (i + 1)) / i);
-          sd = sqrt(variance);
-          if ((1.96 * sd) / sqrt(i + 1) <= maxTolerance * mean) {
-              break;
-          }
+      Intersection isect;
+      Vector3D sample = bdpt ? bdpt->radiance(sampleRay, thread, &isect)
+                             : PathTracer::est_radiance_global_illumination(sampleRay, &isect);
+      estRadiance += sample;
+      illumSum += sample.illum();
+      illumSquared += sample.illum() * sample.illum();
+
+      if (isect.bsdf) {
+        albedo += isect.bsdf->get_albedo();
+        normal += isect.n;
+        depth += isect.t;
+      } else {
+        normal -= sampleRay.d;
+        depth += camera->far_clip();
+      }
+      if (sample_index == 0 && trackPrimitives) {
+        auto id = primitiveIds.find(isect.primitive);
+        primitiveBuffer[index] = id != primitiveIds.end() ? id->second + 1 : 0;
       }
   }
-  estRadiance /= ns_aa;     // normalize by number of samples
+  end_pixel_sample();
+  if (num_samples == 0) return;
+
+  // Fold this batch into the running mean of the pixel, weighted by how many
+  // samples the pixel has already accumulated in earlier passes. The squared
+  // deviations combine as in Chan et al.'s pairwise update, which stays
+  // accurate in single precision where a raw sum of squares would cancel.
+  size_t previous = sampleCountBuffer[index];
+  size_t total = previous + num_samples;
+  float r = (float) num_samples / total;
+  double batch_mean = illumSum / num_samples;
+  double delta = batch_mean - Vector3D(sampleBuffer.data[index]).illum();
+  double batch_deviation = std::max(illumSquared - illumSum * batch_mean, 0.0);
+  illumDeviationBuffer[index] += batch_deviation + delta * delta * previous * num_samples / total;
+  sampleBuffer.update_pixel(estRadiance / num_samples, x, y, r);
+  albedoBuffer.update_pixel(albedo / num_samples, x, y, r);
+  normalBuffer.update_pixel(normal / num_samples, x, y, r);
+  depthBuffer[index] += (depth / num_samples - depthBuffer[index]) * r;
+  sampleCountBuffer[index] = total;
+}
+
+double PathTracer::pixel_error(size_t x, size_t y) const {
+  size_t index = x + y * sampleBuffer.w;
+  size_t n = sampleCountBuffer[index];
+  if (n < 2) return INF_D;
 
-  sampleBuffer.update_pixel(estRadiance, x, y);
-  sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
+  double mean = Vector3D(sampleBuffer.data[index]).illum();
+  double interval = 1.96 * sqrt(pixel_variance(x, y));
+  if (interval == 0) return 0;
+  return mean > 0 ? interval / mean : INF_D;
+}
+
+double PathTracer::pixel_variance(size_t x, size_t y) const {
+  size_t index = x + y * sampleBuffer.w;
+  size_t n = sampleCountBuffer[index];
+
+  // The mean illuminance of the samples is the illuminance of the mean
+  // radiance, so only the squared deviations need their own buffer.
+  if (n < 2) {
+    double mean = Vector3D(sampleBuffer.data[index]).illum();
+    return mean * mean;
+  }
+  double variance = illumDeviationBuffer[index] / (n - 1);
+  return variance / n;
 }
 
 void PathTracer::autofocus(Vector2D loc) {
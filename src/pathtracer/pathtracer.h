@@ -1,11 +1,19 @@
 #ifndef CGL_PATHTRACER_H
 #define CGL_PATHTRACER_H
 
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
 #include "CGL/timer.h"
 
 #include "scene/bvh.h"
 #include "pathtracer/sampler.h"
 #include "pathtracer/intersection.h"
+#include "pathtracer/path_guide.h"
+#include "pathtracer/irradiance_cache.h"
+#include "pathtracer/photon_map.h"
+#include "pathtracer/bdpt.h"
 
 #include "application/renderer.h"
 
@@ -20,6 +28,19 @@ using CGL::SceneObjects::BVHAccel;
 
 namespace CGL {
 
+    /**
+     * Arbitrary output variables: passes of first-hit data that can be
+     * written alongside the image, for compositing and external denoisers.
+     */
+    enum AOVPass {
+        AOV_DEPTH = 1 << 0,    ///< distance along the camera ray
+        AOV_NORMAL = 1 << 1,   ///< shading normal
+        AOV_ALBEDO = 1 << 2,   ///< surface albedo
+        AOV_ID = 1 << 3,       ///< primitive and material ids
+        AOV_SAMPLES = 1 << 4,  ///< samples taken
+        AOV_ALL = (1 << 5) - 1
+    };
+
     class PathTracer {
     public:
         PathTracer();
@@ -35,7 +56,21 @@ namespace CGL {
          */
         void set_frame_size(size_t width, size_t height);
 
-        void write_to_framebuffer(ImageBuffer& framebuffer, size_t x0, size_t y0, size_t x1, size_t y1);
+        /**
+         * Make the buffers hold rows [y0, y0 + height of the frame) of an
+         * image of the given height, rather than a whole image. Pixels are
+         * sampled and seeded as in a render of the whole image.
+         * \param image_height rows of the whole image (0 = the frame is the image)
+         */
+        void set_band(size_t y0, size_t image_height);
+
+        /**
+         * Encode the samples over [x0, x1) x [y0, y1) into the frame buffer,
+         * with the tonemapping gamma and level of when the frame size was set.
+         * \param pool threads to spread the rows over (NULL for the calling thread only)
+         */
+        void write_to_framebuffer(ImageBuffer& framebuffer, size_t x0, size_t y0, size_t x1, size_t y1,
+                                  ThreadPool* pool = NULL);
 
         /**
          * If the pathtracer is in READY, delete all internal data, transition to INIT.
@@ -50,10 +85,58 @@ namespace CGL {
         Vector3D estimate_direct_lighting_hemisphere(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect);
 
-        Vector3D est_radiance_global_illumination(const Ray& r);
+        /**
+         * Estimate the radiance along a camera ray. If first_hit is given, the
+         * ray's first intersection is stored there (bsdf stays NULL on a miss).
+         */
+        Vector3D est_radiance_global_illumination(const Ray& r, SceneObjects::Intersection* first_hit = NULL);
         Vector3D zero_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D at_least_one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
+
+        /**
+         * Indirect part of at_least_one_bounce_radiance: the radiance brought
+         * in by one sampled bounce, zero if Russian roulette ends the path.
+         */
+        Vector3D bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
+
+        /**
+         * Radiance leaving a camera path vertex towards the ray, other than
+         * its emission, for paths through nothing but mirrors and glass so
+         * far. The first glass and the first non-delta surface on the path
+         * are split into split_count(bsdf) bounces.
+         * \param bounces number of the vertex along the path, 1 at the camera hit
+         */
+        Vector3D camera_path_radiance(const Ray& r, const SceneObjects::Intersection& isect, size_t bounces);
+
+        /**
+         * Number of bounces to split a camera path into at a surface:
+         * ns_diff, ns_glsy or ns_refr depending on its BSDF, and 1 for
+         * everything else.
+         */
+        size_t split_count(const BSDF* bsdf) const;
+
+        /**
+         * Indirect irradiance at a point, interpolated from irradianceCache,
+         * or traced into a new cache record if no record is close enough.
+         * \param depth depth of the ray that hit the point
+         */
+        Vector3D cached_irradiance(const Vector3D& p, const Vector3D& n, int depth);
+
+        /**
+         * Emit photons from the scene's lights and store the caustic ones:
+         * those that reached a non-delta surface through mirrors and glass
+         * only. Emission stops once count photons are stored, or when
+         * caustics turn out too rare to get there.
+         * \return the number of photons emitted
+         */
+        size_t trace_caustic_photons(size_t count, std::vector<Photon>* out);
+
+        /**
+         * Radiance leaving a non-delta surface towards the ray, from the
+         * caustic photons around the hit.
+         */
+        Vector3D caustic_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         
         Vector3D debug_shading(const Vector3D d) {
             return Vector3D(abs(d.r), abs(d.g), .0).unit();
@@ -64,9 +147,28 @@ namespace CGL {
         }
 
         /**
-         * Trace a camera ray given by the pixel coordinate.
+         * Trace up to num_samples camera rays through the pixel coordinate and
+         * accumulate them into the pixel's running mean. Pixels may be visited
+         * several times (progressive rendering); sampleCountBuffer holds the
+         * number of samples accumulated so far.
+         * \param thread index of the calling render thread, for integrators
+         *        that keep per-thread state
+         */
+        void raytrace_pixel(size_t x, size_t y, size_t num_samples, size_t thread = 0);
+
+        /**
+         * Half-width of the 95% confidence interval of the pixel's mean
+         * illuminance, relative to the mean. Infinite until the pixel has
+         * two samples.
          */
-        void raytrace_pixel(size_t x, size_t y);
+        double pixel_error(size_t x, size_t y) const;
+
+        /**
+         * Estimated variance of the pixel's mean illuminance. With fewer than
+         * two samples there is no estimate, and the squared mean is returned
+         * (i.e. the pixel is assumed to be entirely noise).
+         */
+        double pixel_variance(size_t x, size_t y) const;
 
         // Integrator sampling settings //
 
@@ -77,9 +179,22 @@ namespace CGL {
         size_t ns_glsy;       ///< number of samples - glossy surfaces
         size_t ns_refr;       ///< number of samples - refractive surfaces
 
-        size_t samplesPerBatch;
-        double maxTolerance;
+        size_t samplesPerBatch;  ///< adaptive sampling: samples per pixel per pass
+        double maxTolerance;     ///< adaptive sampling: relative error target (0 disables)
         bool direct_hemisphere_sample; ///< true if sampling uniformly from hemisphere for direct lighting. Otherwise, light sample
+        SampleSequence sampleSequence; ///< sequence camera, light and BSDF sampling draw from within a pixel sample
+        uint32_t seed;                 ///< global seed the random numbers of every pixel sample derive from
+
+        PathGuide* pathGuide;    ///< learned incident radiance for bounce sampling (NULL = BSDF sampling only)
+        double guideFraction;    ///< probability of sampling a bounce from pathGuide rather than the BSDF
+
+        IrradianceCache* irradianceCache;  ///< indirect irradiance at camera hits on diffuse surfaces (NULL = trace every hit)
+        size_t ns_irradiance;    ///< number of hemisphere rays per irradiance cache record
+
+        bool gatherCaustics;     ///< add the caustics of causticMap at camera hits
+        std::shared_ptr<const PhotonMap> causticMap;  ///< photons for light arriving through mirrors and glass, swapped with std::atomic_store while rendering
+
+        BidirectionalPathTracer* bdpt;  ///< integrator used instead of est_radiance_global_illumination (NULL = unidirectional)
 
         // Components //
 
@@ -87,10 +202,26 @@ namespace CGL {
         EnvironmentLight* envLight;    ///< environment map
         Sampler2D* gridSampler;        ///< samples unit grid
         Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
-        HDRImageBuffer sampleBuffer;   ///< sample buffer
+        FloatImageBuffer sampleBuffer; ///< sample buffer
+        size_t bandStart;              ///< image row of the buffers' first row
+        size_t imageHeight;            ///< rows of the image the buffers are a band of (0 = all of it)
         Timer timer;                   ///< performance test timer
 
         std::vector<int> sampleCountBuffer;   ///< sample count buffer
+        std::vector<float> illumDeviationBuffer; ///< per-pixel sum of squared deviations of sample illuminance from the mean
+
+        // First-hit features, averaged over each pixel's samples like
+        // sampleBuffer. Misses store a black albedo, the reversed ray
+        // direction as normal, and the far clip distance as depth.
+        HalfImageBuffer albedoBuffer;  ///< first-hit albedo
+        HalfImageBuffer normalBuffer;  ///< first-hit shading normal
+        std::vector<float> depthBuffer;   ///< first-hit distance along the camera ray
+
+        // Ids are not averaged: a pixel keeps the primitive its first
+        // sample hit, as 1 + the primitive's index in primitiveIds (0 = a miss).
+        bool trackPrimitives;          ///< fill primitiveBuffer (otherwise it stays empty)
+        std::unordered_map<const SceneObjects::Primitive*, uint32_t> primitiveIds;  ///< index of each primitive of the scene
+        std::vector<uint32_t> primitiveBuffer;  ///< first-hit primitive of each pixel's first sample
 
         Scene* scene;         ///< current scene
         Camera* camera;       ///< current camera
@@ -101,6 +232,7 @@ namespace CGL {
         double tm_level;                           ///< exposure level
         double tm_key;                             ///< key value
         double tm_wht;                             ///< white point
+        ColorEncoder colorEncoder;                 ///< encodes samples with tm_gamma and tm_level
     };
 
 }  // namespace CGL
@@ -0,0 +1,119 @@
+#include "photon_map.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace CGL {
+
+Photon::Photon(const Vector3D& pos, const Vector3D& pow, const Vector3D& dir) {
+  for (int i = 0; i < 3; i++) {
+    p[i] = pos[i];
+    power[i] = pow[i];
+    wi[i] = dir[i];
+  }
+  axis = 0;
+}
+
+static inline double dist2(const Photon& photon, const float p[3]) {
+  double dx = photon.p[0] - p[0], dy = photon.p[1] - p[1], dz = photon.p[2] - p[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+PhotonMap::PhotonMap(std::vector<Photon>& stored, size_t emitted, double radius,
+                     size_t k)
+    : numEmitted(emitted), gatherRadius(radius), k(k) {
+  photons.swap(stored);
+  build(0, photons.size());
+}
+
+void PhotonMap::build(size_t begin, size_t end) {
+  if (end - begin < 2) {
+    if (begin < end) photons[begin].axis = 0;
+    return;
+  }
+
+  float lo[3] = { INFINITY, INFINITY, INFINITY };
+  float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+  for (size_t i = begin; i < end; i++) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = std::min(lo[a], photons[i].p[a]);
+      hi[a] = std::max(hi[a], photons[i].p[a]);
+    }
+  }
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+  }
+
+  size_t mid = begin + (end - begin) / 2;
+  std::nth_element(photons.begin() + begin, photons.begin() + mid,
+                   photons.begin() + end,
+                   [axis](const Photon& a, const Photon& b) {
+                     return a.p[axis] < b.p[axis];
+                   });
+  photons[mid].axis = axis;
+  build(begin, mid);
+  build(mid + 1, end);
+}
+
+void PhotonMap::gather(const Vector3D& p, std::vector<const Photon*>* found,
+                       double* r2) const {
+  found->clear();
+  float q[3] = { (float) p.x, (float) p.y, (float) p.z };
+  *r2 = gatherRadius * gatherRadius;
+  if (k == 0) {
+    within(0, photons.size(), q, *r2, found);
+    return;
+  }
+
+  // found is kept as a max-heap on distance while it fills up, so the
+  // farthest photon is the one replaced and its distance bounds the search.
+  nearest(0, photons.size(), q, found, r2);
+  if (found->size() < k) *r2 = gatherRadius * gatherRadius;
+}
+
+void PhotonMap::nearest(size_t begin, size_t end, const float p[3],
+                        std::vector<const Photon*>* heap, double* r2) const {
+  if (begin >= end) return;
+  size_t mid = begin + (end - begin) / 2;
+  const Photon& photon = photons[mid];
+
+  // Visit the half containing the point first; it usually shrinks the
+  // search radius enough to skip the other half.
+  double d = p[photon.axis] - photon.p[photon.axis];
+  if (d < 0) {
+    nearest(begin, mid, p, heap, r2);
+    if (d * d < *r2) nearest(mid + 1, end, p, heap, r2);
+  } else {
+    nearest(mid + 1, end, p, heap, r2);
+    if (d * d < *r2) nearest(begin, mid, p, heap, r2);
+  }
+
+  double d2 = dist2(photon, p);
+  if (d2 >= *r2) return;
+
+  auto farther = [p](const Photon* a, const Photon* b) {
+    return dist2(*a, p) < dist2(*b, p);
+  };
+  if (heap->size() == k) {
+    std::pop_heap(heap->begin(), heap->end(), farther);
+    heap->pop_back();
+  }
+  heap->push_back(&photon);
+  std::push_heap(heap->begin(), heap->end(), farther);
+  if (heap->size() == k) *r2 = dist2(*heap->front(), p);
+}
+
+void PhotonMap::within(size_t begin, size_t end, const float p[3], double r2,
+                       std::vector<const Photon*>* found) const {
+  if (begin >= end) return;
+  size_t mid = begin + (end - begin) / 2;
+  const Photon& photon = photons[mid];
+
+  double d = p[photon.axis] - photon.p[photon.axis];
+  if (d < 0 || d * d < r2) within(begin, mid, p, r2, found);
+  if (d >= 0 || d * d < r2) within(mid + 1, end, p, r2, found);
+  if (dist2(photon, p) < r2) found->push_back(&photon);
+}
+
+}  // namespace CGL
@@ -0,0 +1,77 @@
+#ifndef CGL_PHOTON_MAP_H
+#define CGL_PHOTON_MAP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "CGL/vector3D.h"
+
+namespace CGL {
+
+/**
+ * A photon stored where it landed. Single precision keeps millions of them
+ * in cache-friendly 40 bytes each.
+ */
+struct Photon {
+  float p[3];       ///< position
+  float power[3];   ///< power carried, before dividing by the photons emitted
+  float wi[3];      ///< unit direction the photon came from
+  uint8_t axis;     ///< split axis of the photon's kd-tree node
+
+  Photon() { }
+  Photon(const Vector3D& pos, const Vector3D& pow, const Vector3D& dir);
+
+  Vector3D position() const { return Vector3D(p[0], p[1], p[2]); }
+  Vector3D flux() const { return Vector3D(power[0], power[1], power[2]); }
+  Vector3D direction() const { return Vector3D(wi[0], wi[1], wi[2]); }
+};
+
+/**
+ * Photons in a balanced kd-tree (Jensen 1996) for density estimation.
+ *
+ * The tree is implicit: the photons of a subrange are ordered so that the
+ * median along the subrange's widest axis sits in the middle, with the
+ * lower half before it and the upper half after it. Maps are immutable once
+ * built and can be queried from any number of threads.
+ */
+class PhotonMap {
+ public:
+
+  /**
+   * Build a map, taking over the photons.
+   * \param photons photons stored by the emission pass (left empty)
+   * \param emitted number of photons emitted to store them
+   * \param radius largest gather radius
+   * \param k photons per gather, the nearest ones within the radius
+   *          (0 = every photon within the radius)
+   */
+  PhotonMap(std::vector<Photon>& photons, size_t emitted, double radius, size_t k);
+
+  /**
+   * Find the photons to estimate the density around a point from.
+   * \param found address to store the photons
+   * \param r2 address to store the squared radius the photons lie within
+   */
+  void gather(const Vector3D& p, std::vector<const Photon*>* found, double* r2) const;
+
+  size_t size() const { return photons.size(); }
+  size_t emitted() const { return numEmitted; }
+  double radius() const { return gatherRadius; }
+
+ private:
+
+  void build(size_t begin, size_t end);
+  void nearest(size_t begin, size_t end, const float p[3],
+               std::vector<const Photon*>* heap, double* r2) const;
+  void within(size_t begin, size_t end, const float p[3], double r2,
+              std::vector<const Photon*>* found) const;
+
+  std::vector<Photon> photons;
+  size_t numEmitted;
+  double gatherRadius;
+  size_t k;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_PHOTON_MAP_H
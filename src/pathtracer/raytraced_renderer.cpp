@@ -6,11 +6,23 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <deque>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
 #include "CGL/matrix3x3.h"
-#include "CGL/lodepng.h"
+#include "util/lodepng.h"
 
 #include "GL/glew.h"
 
@@ -47,7 +59,24 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
                        bool direct_hemisphere_sample,
                        string filename,
                        double lensRadius,
-                       double focalDistance) {
+                       double focalDistance,
+                       size_t samples_per_pass,
+                       double time_budget,
+                       bool denoise,
+                       bool path_guiding,
+                       double irradiance_cache_error,
+                       size_t caustic_photons,
+                       bool bidirectional,
+                       SampleSequence sample_sequence,
+                       long long seed,
+                       size_t worker_processes,
+                       string checkpoint_file,
+                       double checkpoint_interval,
+                       bool interactive,
+                       bool stream_exr,
+                       int aov_passes,
+                       string scene_file,
+                       std::shared_ptr<ThreadPool> thread_pool) {
   state = INIT;
 
   pt = new PathTracer();
@@ -56,16 +85,39 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
   pt->max_ray_depth = max_ray_depth;                        // Maximum recursion ray depth
   pt->ns_area_light = ns_area_light;                        // Number of samples for area light
   pt->ns_diff = ns_diff;                                    // Number of samples for diffuse surface
-  pt->ns_glsy = ns_diff;                                    // Number of samples for glossy surface
+  pt->ns_glsy = ns_glsy;                                    // Number of samples for glossy surface
   pt->ns_refr = ns_refr;                                    // Number of samples for refraction
   pt->samplesPerBatch = samples_per_batch;                  // Number of samples per batch
   pt->maxTolerance = max_tolerance;                         // Maximum tolerance for early termination
   pt->direct_hemisphere_sample = direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
+  pt->sampleSequence = sample_sequence;                     // Sequence pixel samples draw their random numbers from
+  pt->seed = seed >= 0 ? (uint32_t) seed : 0;               // Seed of every pixel sample's random numbers
 
   this->lensRadius = lensRadius;
   this->focalDistance = focalDistance;
 
   this->filename = filename;
+  sceneFile = scene_file;
+
+  samplesPerPass = samples_per_pass;      // Samples per pixel per progressive pass
+  timeBudget = time_budget;               // Seconds before progressive passes stop
+  finishRequested = false;
+  denoiseOutput = denoise;                // Filter the image once rendering completes
+  pathGuiding = path_guiding;             // Guide bounces by learned incident radiance
+  irradianceCacheError = irradiance_cache_error;  // Interpolate indirect light where this accurate
+  causticPhotons = caustic_photons;       // Photons stored per caustic photon map
+  this->bidirectional = bidirectional;    // Connect camera and light subpaths
+  reproducible = seed >= 0;               // Same image on any number of threads
+  checkpointFile = checkpoint_file;       // Where full-frame renders save and resume their samples
+  checkpointInterval = checkpoint_interval;  // Seconds between checkpoints
+  checkpointRunning = false;
+  this->interactive = interactive;        // Coarse previews first, reprojected on camera moves
+  reprojectPending = false;
+  if (interactive && samplesPerPass == 0) samplesPerPass = 1;
+  streamExr = stream_exr;                 // File renders go to a tiled EXR band by band
+  streaming = false;
+  aovPasses = aov_passes;                 // First-hit passes saved with the image
+  pt->trackPrimitives = (aov_passes & AOV_ID) != 0;
 
   if (envmap) {
     pt->envLight = new EnvironmentLight(envmap);
@@ -79,9 +131,12 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
 
   show_rays = true;
 
+  adaptiveMaxRate = 4;                    // Adaptive pixels may take up to 4x ns_aa samples
   imageTileSize = 32;                     // Size of the rendering tile.
   numWorkerThreads = num_threads;         // Number of threads
-  workerThreads.resize(numWorkerThreads);
+  workerPool = thread_pool ? thread_pool : std::make_shared<ThreadPool>();  // Kept between renders; shared if given
+  numWorkerProcesses = worker_processes;  // Processes a file render is spread over
+  cellElapsed = 0;
 }
 
 /**
@@ -90,6 +145,10 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
  */
 RaytracedRenderer::~RaytracedRenderer() {
 
+  continueRaytracing = false;
+  workerPool->wait();
+  stop_checkpointing();
+
   delete bvh;
   delete pt;
 
@@ -127,15 +186,17 @@ void RaytracedRenderer::set_scene(Scene *scene) {
 }
 
 /**
- * If in the INIT state, configures the pathtracer to use the given camera. If
+ * Configures the pathtracer to use the given camera, with the lens settings
+ * it was created with. If in a running state, transitions to READY first,
+ * so a batch of renders can move the camera between frames. If
  * configuration is done, transitions to the READY state.
  * This DOES NOT take ownership of the camera, and doesn't delete it ever.
  * \param camera the camera to use in rendering
  */
 void RaytracedRenderer::set_camera(Camera *camera) {
 
-  if (state != INIT) {
-    return;
+  if (state != INIT && state != READY) {
+    stop();
   }
 
   camera->focalDistance = focalDistance;
@@ -163,12 +224,15 @@ void RaytracedRenderer::set_frame_size(size_t width, size_t height) {
   frame_w = width;
   frame_h = height;
 
-  frameBuffer.resize(width, height);
   cell_tl = Vector2D(0,0); 
   cell_br = Vector2D(width, height);
   render_cell = false;
 
-  pt->set_frame_size(width, height);
+  // A streamed render allocates its buffers one band at a time.
+  if (!streamExr) {
+    frameBuffer.resize(width, height);
+    pt->set_frame_size(width, height);
+  }
 
   if (has_valid_configuration()) {
     state = READY;
@@ -224,11 +288,9 @@ void RaytracedRenderer::stop() {
       break;
     case RENDERING:
       continueRaytracing = false;
+      wake_idle_workers();
     case DONE:
-      for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i]->join();
-            delete workerThreads[i];
-        }
+      workerPool->wait();
       state = READY;
       break;
   }
@@ -268,7 +330,7 @@ void RaytracedRenderer::start_raytracing() {
   if (state != READY) return;
 
   rayLog.clear();
-  workQueue.clear();
+  tiles.clear();
 
   state = RENDERING;
   continueRaytracing = true;
@@ -284,51 +346,196 @@ void RaytracedRenderer::start_raytracing() {
   pt->camera = camera;
   pt->scene = scene;
 
+  if (pathGuiding) {
+    pathGuide.reset(bvh->get_bbox());
+    pt->pathGuide = &pathGuide;
+  }
+  if (irradianceCacheError > 0) {
+    irradianceCache.reset(bvh->get_bbox(), irradianceCacheError);
+    pt->irradianceCache = &irradianceCache;
+  }
+
+  pt->bdpt = NULL;
+  if (bidirectional) {
+    bdpt.reset(pt, numWorkerThreads);
+    pt->bdpt = &bdpt;
+  }
+
+  // Caustics start from a gather radius of a percent of the scene size. A
+  // single-pass render gathers the nearest photons within it; progressive
+  // passes gather everything within a radius that shrinks every pass.
+  std::atomic_store(&pt->causticMap, std::shared_ptr<const PhotonMap>());
+  pt->gatherCaustics = causticPhotons > 0;
+  causticPass = 0;
+  causticBuilding = false;
+  if (causticPhotons > 0) {
+    double radius = bvh->get_bbox().extent.norm() * 0.01;
+    workerPool->resize(numWorkerThreads);
+    build_caustic_map(radius, samplesPerPass > 0 ? 0 : 64);
+  }
+
+  double resumed_time = 0;
+  long long resumed_samples = 0;
   if (!render_cell) {
-    frameBuffer.clear();
-    num_tiles_w = width / imageTileSize + 1;
-    num_tiles_h = height / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
-    tile_samples.resize(num_tiles_w * num_tiles_h);
-    memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+    if (!reprojectPending) {
+      frameBuffer.clear();
+      reprojected.clear();
+    }
+    reprojectPending = false;
+    num_tiles_w = (width + imageTileSize - 1) / imageTileSize;
+    num_tiles_h = (height + imageTileSize - 1) / imageTileSize;
+
+    // Pick up the samples of an interrupted render of the same frame. Tiles
+    // then only spend what is left of their budgets.
+    if (checkpointFile != "") {
+      stop_checkpointing();
+      checkpoint.reset(width, height, imageTileSize, checkpoint_settings());
+      if (checkpoint.load(checkpointFile, pt, &resumed_time)) {
+        resumed_samples = checkpoint.num_samples();
+        fprintf(stdout, "[PathTracer] Resuming from checkpoint %s (%.2f samples per pixel, %.1f s)\n",
+                checkpointFile.c_str(), (double) resumed_samples / (width * height), resumed_time);
+        pt->write_to_framebuffer(frameBuffer, 0, 0, width, height, workerPool.get());
+      }
+    }
 
     // populate the tile work queue
     for (size_t y = 0; y < height; y += imageTileSize) {
         for (size_t x = 0; x < width; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+            tiles.push_back(WorkItem(x, y, imageTileSize, imageTileSize,
+                                     pt->maxTolerance, tile_budget(x, y)));
         }
     }
+  } else if (!cellBudgets.empty()) {
+    // A worker process's cell is made of the tiles of a render of the whole
+    // frame, with the budgets the coordinator gave them, and its clock
+    // started when the coordinator's did.
+    int w = (cell_br-cell_tl).x;
+    int h = (cell_br-cell_tl).y;
+    num_tiles_w = (w + imageTileSize - 1) / imageTileSize;
+    num_tiles_h = (h + imageTileSize - 1) / imageTileSize;
+    size_t i = 0;
+    for (size_t y = cell_tl.y; y < cell_br.y; y += imageTileSize) {
+      for (size_t x = cell_tl.x; x < cell_br.x; x += imageTileSize) {
+        tiles.push_back(WorkItem(x, y, imageTileSize, imageTileSize,
+                                 pt->maxTolerance, cellBudgets[i++]));
+      }
+    }
+    resumed_time = cellElapsed;
   } else {
     int w = (cell_br-cell_tl).x;
     int h = (cell_br-cell_tl).y;
     int imTS = imageTileSize / 4;
-    num_tiles_w = w / imTS + 1;
-    num_tiles_h = h / imTS + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
-    tile_samples.resize(num_tiles_w * num_tiles_h);
-    memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+    num_tiles_w = (w + imTS - 1) / imTS;
+    num_tiles_h = (h + imTS - 1) / imTS;
 
     // populate the tile work queue
     for (size_t y = cell_tl.y; y < cell_br.y; y += imTS) {
       for (size_t x = cell_tl.x; x < cell_br.x; x += imTS) {
-        workQueue.put_work(WorkItem(x, y, 
-          min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)) ));
+        int tile_w = min(imTS, (int)(cell_br.x-x)), tile_h = min(imTS, (int)(cell_br.y-y));
+        tiles.push_back(WorkItem(x, y, tile_w, tile_h,
+          pt->maxTolerance, (long long) tile_w * tile_h * pt->ns_aa));
       }
     }
   }
 
+  // An interactive render first fills the frame with blocks of 8x8 pixels
+  // from one sample each, then halves the blocks every pass until it gets
+  // to full resolution and accumulates as usual.
+  if (interactive && !render_cell) {
+    previewCamera = *camera;
+    reprojected.resize(width * height, 0);
+    for (WorkItem& tile : tiles) tile.preview_scale = 8;
+  }
+
+  // Queue tiles in a spiral out from the center of the region: the preview
+  // fills in where the subject usually is first, and tiles rendered around
+  // the same time are neighbours that touch the same geometry.
+  double cx = 0, cy = 0;
+  for (const WorkItem& tile : tiles) {
+    cx += tile.tile_x + tile.tile_w * 0.5;
+    cy += tile.tile_y + tile.tile_h * 0.5;
+  }
+  cx /= tiles.size();
+  cy /= tiles.size();
+  int tile_size = render_cell && cellBudgets.empty() ? imageTileSize / 4 : imageTileSize;
+  std::stable_sort(tiles.begin(), tiles.end(), [&](const WorkItem& a, const WorkItem& b) {
+    double ax = (a.tile_x + a.tile_w * 0.5 - cx) / tile_size;
+    double ay = (a.tile_y + a.tile_h * 0.5 - cy) / tile_size;
+    double bx = (b.tile_x + b.tile_w * 0.5 - cx) / tile_size;
+    double by = (b.tile_y + b.tile_h * 0.5 - cy) / tile_size;
+    int ring_a = (int) round(max(fabs(ax), fabs(ay)));
+    int ring_b = (int) round(max(fabs(bx), fabs(by)));
+    if (ring_a != ring_b) return ring_a < ring_b;
+    return atan2(ay, ax) < atan2(by, bx);
+  });
+
+  // Tiles split while rendering (see raytrace_tile) take the spare slots
+  // after the initial tiles, so the vector never reallocates under the
+  // workers. Every tile can be queued at once, so the rings are sized for
+  // all of them.
+  size_t initial_tiles = tiles.size();
+  tiles.resize(initial_tiles * maxTileSplits);
+  tileCount = initial_tiles;
+  idleWorkers = 0;
+
+  // Tiles are dealt out in turn, so every worker starts near the center of
+  // the image; workers that run out steal from the others.
+  workQueue.reset(numWorkerThreads, tiles.size());
+  for (size_t i = 0; i < initial_tiles; i++) {
+    workQueue.put_work(i % numWorkerThreads, i);
+  }
+  tilesActive = initial_tiles;
+
+  // The sample budget is what a uniform render at ns_aa would cost. Adaptive
+  // sampling spends it unevenly but never exceeds it by more than the passes
+  // in flight. Which pixels get to spend it depends on the order tiles are
+  // done in, so reproducible renders split it between tiles up front.
+  size_t num_pixels = render_cell ? (size_t)((cell_br-cell_tl).x * (cell_br-cell_tl).y)
+                                  : width * height;
+  samplesTotal = num_pixels * pt->ns_aa;
+  samplesRemaining = samplesTotal - resumed_samples;
+
+  finishRequested = false;
+  tilesUnderMin = timeBudget > 0 ? initial_tiles : 0;
+  progressShown = -1;
+  renderStart = std::chrono::steady_clock::now() -
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(resumed_time));
+
+  // Checkpoints are written off the render threads, which only copy each
+  // tile into the snapshot once they finish a pass over it.
+  if (checkpointFile != "" && !render_cell) {
+    stop_checkpointing();
+    checkpointRunning = true;
+    checkpointThread = std::thread([this] {
+      std::unique_lock<std::mutex> lk(checkpointLock);
+      while (!checkpointWake.wait_for(lk, std::chrono::duration<double>(checkpointInterval),
+                                      [this] { return !checkpointRunning; })) {
+        lk.unlock();
+        if (!checkpoint.save(checkpointFile, elapsed_time())) {
+          fprintf(stderr, "\n[PathTracer] Could not write checkpoint %s\n", checkpointFile.c_str());
+        }
+        lk.lock();
+      }
+    });
+  }
+
   bvh->total_isects = 0; bvh->total_rays = 0;
   // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-  for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this);
-  }
+  workerPool->resize(numWorkerThreads);
+  workerPool->run([this](size_t thread) { worker_thread(thread); });
 }
 
 void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
-  if (x == -1) {
+  if (x == -1 && streamExr) {
+    if (!render_streamed(filename)) return;
+    fprintf(stdout, "[PathTracer] Job completed.\n");
+  } else if (x == -1 && numWorkerProcesses > 0) {
+    if (!render_distributed()) return;
+    save_image(filename);
+    fprintf(stdout, "[PathTracer] Job completed.\n");
+  } else if (x == -1) {
     unique_lock<std::mutex> lk(m_done);
     start_raytracing();
     cv_done.wait(lk, [this]{ return state == DONE; });
@@ -347,6 +554,471 @@ void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size
 }
 
 
+std::vector<std::pair<std::string, std::string>> RaytracedRenderer::render_to_png(
+    std::vector<unsigned char>& png, size_t x, size_t y, size_t dx, size_t dy) {
+  if (x == -1) {
+    unique_lock<std::mutex> lk(m_done);
+    start_raytracing();
+    cv_done.wait(lk, [this]{ return state == DONE; });
+    lk.unlock();
+    encode_png(png, flip_rows(frameBuffer), frameBuffer.w, frameBuffer.h, render_stats());
+  } else {
+    render_cell = true;
+    cell_tl = Vector2D(x,y);
+    cell_br = Vector2D(x+dx,y+dy);
+    ImageBuffer buffer;
+    raytrace_cell(buffer);
+    encode_png(png, flip_rows(buffer), buffer.w, buffer.h, render_stats());
+  }
+  return render_stats();
+}
+
+bool RaytracedRenderer::render_streamed(const std::string& filename) {
+  size_t width = frame_w;
+  size_t height = frame_h;
+  TiledExrWriter exr;
+  if (!exr.open(filename, width, height, imageTileSize, exr_channels())) {
+    fprintf(stderr, "[PathTracer] Could not write %s\n", filename.c_str());
+    return false;
+  }
+
+  // Bands are whole rows of tiles counted from the bottom, as in a render
+  // of the whole frame, so a reproducible render splits its budget over
+  // the same tiles and ends up with the same samples. Finished bands go to
+  // the writer threads while the next one renders; the writer's bounded
+  // queue keeps at most a few bands in memory.
+  size_t band_rows = imageTileSize * 4;
+  size_t num_bands = (height + band_rows - 1) / band_rows;
+  streaming = true;
+  streamTotals = FrameStats();
+  auto streamStart = std::chrono::steady_clock::now();
+  for (size_t band = 0; band < num_bands; band++) {
+    size_t y0 = band * band_rows;
+    size_t rows = std::min(band_rows, height - y0);
+    fprintf(stdout, "[PathTracer] Band %zu of %zu (rows %zu to %zu)\n", band + 1, num_bands, y0, y0 + rows);
+
+    frame_h = rows;
+    cell_br = Vector2D(width, rows);
+    frameBuffer.resize(width, rows);
+    pt->set_band(y0, height);
+
+    unique_lock<std::mutex> lk(m_done);
+    start_raytracing();
+    cv_done.wait(lk, [this]{ return state == DONE; });
+    lk.unlock();
+    stop();
+
+    add_frame_stats(streamTotals);
+
+    auto values = exr_pixels();
+    size_t file_y = height - y0 - rows;
+    imageWriter.push([&exr, values, file_y, rows]() {
+      exr.add_rows(file_y, rows, values->data());
+    });
+  }
+  imageWriter.wait();
+
+  // Leave the renderer as a full frame with nothing allocated, for the
+  // next render.
+  pt->set_band(0, 0);
+  pt->set_frame_size(0, 0);
+  frameBuffer.resize(0, 0);
+  frame_h = height;
+  cell_br = Vector2D(width, height);
+
+  renderStart = streamStart;
+  for (const auto& stat : render_stats()) {
+    fprintf(stdout, "[PathTracer] %s: %s\n", stat.first.c_str(), stat.second.c_str());
+  }
+  streaming = false;
+
+  if (!exr.close()) {
+    fprintf(stderr, "[PathTracer] Could not write %s\n", filename.c_str());
+    return false;
+  }
+  fprintf(stderr, "[PathTracer] Saved %s\n", filename.c_str());
+  return true;
+}
+
+std::vector<TiledExrWriter::Channel> RaytracedRenderer::exr_channels() const {
+  std::vector<TiledExrWriter::Channel> channels = {{"R", true}, {"G", true}, {"B", true}};
+  if (aovPasses & AOV_DEPTH) {
+    channels.push_back({"depth.Z", false});
+  }
+  if (aovPasses & AOV_NORMAL) {
+    channels.insert(channels.end(), {{"normal.X", true}, {"normal.Y", true}, {"normal.Z", true}});
+  }
+  if (aovPasses & AOV_ALBEDO) {
+    channels.insert(channels.end(), {{"albedo.R", true}, {"albedo.G", true}, {"albedo.B", true}});
+  }
+  // Ids and counts are whole numbers, exact as floats up to 2^24.
+  if (aovPasses & AOV_ID) {
+    channels.insert(channels.end(), {{"id.primitive", false}, {"id.material", false}});
+  }
+  if (aovPasses & AOV_SAMPLES) {
+    channels.push_back({"samples.count", false});
+  }
+  return channels;
+}
+
+std::shared_ptr<std::vector<float>> RaytracedRenderer::exr_pixels() const {
+  size_t w = pt->sampleBuffer.w;
+  size_t h = pt->sampleBuffer.h;
+  size_t num_channels = exr_channels().size();
+  auto values = std::make_shared<std::vector<float>>(w * h * num_channels);
+
+  // The file counts rows top-down, the buffers bottom-up.
+  float* out = values->data();
+  for (size_t r = 0; r < h; r++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t i = x + (h - 1 - r) * w;
+      const FloatRGB& radiance = pt->sampleBuffer.data[i];
+      *out++ = radiance.r; *out++ = radiance.g; *out++ = radiance.b;
+      if (aovPasses & AOV_DEPTH) {
+        *out++ = pt->depthBuffer[i];
+      }
+      if (aovPasses & AOV_NORMAL) {
+        Vector3D normal = pt->normalBuffer.data[i];
+        *out++ = normal.x; *out++ = normal.y; *out++ = normal.z;
+      }
+      if (aovPasses & AOV_ALBEDO) {
+        Vector3D albedo = pt->albedoBuffer.data[i];
+        *out++ = albedo.x; *out++ = albedo.y; *out++ = albedo.z;
+      }
+      if (aovPasses & AOV_ID) {
+        uint32_t primitive = pt->primitiveBuffer[i];
+        *out++ = primitive;
+        *out++ = primitive ? primitiveMaterials[primitive - 1] + 1 : 0;
+      }
+      if (aovPasses & AOV_SAMPLES) {
+        *out++ = pt->sampleCountBuffer[i];
+      }
+    }
+  }
+  return values;
+}
+
+long long RaytracedRenderer::tile_budget(size_t x, size_t y) const {
+  long long budget = 0;
+  for (size_t py = y; py < min(y + imageTileSize, frame_h); py++) {
+    for (size_t px = x; px < min(x + imageTileSize, frame_w); px++) {
+      budget += (long long) pt->ns_aa - pt->sampleCountBuffer[px + py * frame_w];
+    }
+  }
+  return budget;
+}
+
+void RaytracedRenderer::set_samples_per_pixel(size_t ns_aa) {
+  if (state != INIT && state != READY) {
+    stop();
+  }
+  pt->ns_aa = ns_aa;
+}
+
+#ifndef _WIN32
+
+namespace {
+
+/**
+ * What a worker process sends back for each pixel of a cell: everything the
+ * path tracer accumulates for the pixel, so the coordinator's buffers end up
+ * as if it had traced the samples itself.
+ */
+struct CellPixel {
+  FloatRGB radiance;
+  HalfRGB albedo;
+  HalfRGB normal;
+  float depth;
+  float illum_deviation;
+  int32_t count;
+  uint32_t primitive;
+};
+
+bool read_fully(int fd, void* data, size_t size) {
+  char* p = (char*) data;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool write_fully(int fd, const void* data, size_t size) {
+  const char* p = (const char*) data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+void RaytracedRenderer::serve_cells(int socket) {
+  int32_t cell[4];
+  std::vector<CellPixel> pixels;
+  while (read_fully(socket, cell, sizeof(cell)) &&
+         read_fully(socket, &cellElapsed, sizeof(cellElapsed))) {
+    size_t tiles_w = (cell[2] - cell[0] + imageTileSize - 1) / imageTileSize;
+    size_t tiles_h = (cell[3] - cell[1] + imageTileSize - 1) / imageTileSize;
+    cellBudgets.resize(tiles_w * tiles_h);
+    if (!read_fully(socket, cellBudgets.data(), cellBudgets.size() * sizeof(long long))) break;
+    stop();
+    render_cell = true;
+    cell_tl = Vector2D(cell[0], cell[1]);
+    cell_br = Vector2D(cell[2], cell[3]);
+    {
+      unique_lock<std::mutex> lk(m_done);
+      start_raytracing();
+      cv_done.wait(lk, [this]{ return state == DONE; });
+    }
+
+    pixels.clear();
+    for (int y = cell[1]; y < cell[3]; y++) {
+      for (int x = cell[0]; x < cell[2]; x++) {
+        size_t i = x + y * frame_w;
+        CellPixel p = {pt->sampleBuffer.data[i], pt->albedoBuffer.data[i],
+                       pt->normalBuffer.data[i], pt->depthBuffer[i],
+                       pt->illumDeviationBuffer[i], pt->sampleCountBuffer[i],
+                       pt->trackPrimitives ? pt->primitiveBuffer[i] : 0};
+        pixels.push_back(p);
+      }
+    }
+    if (!write_fully(socket, cell, sizeof(cell)) ||
+        !write_fully(socket, pixels.data(), pixels.size() * sizeof(CellPixel))) {
+      break;
+    }
+  }
+}
+
+bool RaytracedRenderer::render_distributed() {
+  stop();
+  render_cell = false;
+  pt->clear();
+  pt->set_frame_size(frame_w, frame_h);
+  pt->bvh = bvh;
+  pt->camera = camera;
+  pt->scene = scene;
+  frameBuffer.clear();
+
+  // Cells are squares of 4x4 tiles, so each keeps a worker's threads busy
+  // for a while and the rest of the frame stays available to others. They
+  // go out with the budgets of their tiles and the time the render has
+  // taken so far, so a worker samples a cell as this process would sample
+  // the same tiles, and a time budget runs out for the whole frame at once.
+  struct Cell { int32_t x0, y0, x1, y1; };
+  std::vector<Cell> cells;
+  std::vector<std::vector<long long>> cellTiles;
+  size_t cell_size = imageTileSize * 4;
+  for (size_t y = 0; y < frame_h; y += cell_size) {
+    for (size_t x = 0; x < frame_w; x += cell_size) {
+      Cell cell = {(int32_t) x, (int32_t) y,
+                   (int32_t) min(x + cell_size, frame_w),
+                   (int32_t) min(y + cell_size, frame_h)};
+      cells.push_back(cell);
+      std::vector<long long> budgets;
+      for (size_t ty = y; ty < (size_t) cell.y1; ty += imageTileSize) {
+        for (size_t tx = x; tx < (size_t) cell.x1; tx += imageTileSize) {
+          budgets.push_back(tile_budget(tx, ty));
+        }
+      }
+      cellTiles.push_back(budgets);
+    }
+  }
+  std::deque<size_t> pending;
+  for (size_t i = 0; i < cells.size(); i++) pending.push_back(i);
+  std::vector<int> attempts(cells.size(), 0);
+
+  // A worker that dies takes only its current cell with it: the cell goes
+  // back to the front of the queue and a fresh worker takes the dead one's
+  // place. Workers are forked copies of this process, scene and BVH
+  // included, so this must run before any render threads are started.
+  struct Worker { pid_t pid; int socket; long cell; };
+  std::vector<Worker> workers(numWorkerProcesses);
+  auto spawn = [&](size_t w) {
+    workers[w].cell = -1;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      workers[w].pid = -1;
+      workers[w].socket = -1;
+      return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      for (const Worker& other : workers) {
+        if (other.socket >= 0) close(other.socket);
+      }
+      if (!freopen("/dev/null", "w", stdout)) _exit(1);
+      denoiseOutput = false;
+      serve_cells(fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    workers[w].pid = pid;
+    workers[w].socket = pid > 0 ? fds[0] : -1;
+    if (pid < 0) close(fds[0]);
+  };
+  auto retire = [&](size_t w) {
+    if (workers[w].socket >= 0) close(workers[w].socket);
+    if (workers[w].pid > 0) {
+      kill(workers[w].pid, SIGKILL);
+      waitpid(workers[w].pid, NULL, 0);
+    }
+    workers[w].pid = -1;
+    workers[w].socket = -1;
+  };
+
+  signal(SIGPIPE, SIG_IGN);
+  for (size_t w = 0; w < workers.size(); w++) {
+    workers[w].socket = -1;
+  }
+  for (size_t w = 0; w < workers.size(); w++) {
+    spawn(w);
+    if (workers[w].pid < 0) {
+      fprintf(stderr, "[PathTracer] Could not start worker process: %s\n", strerror(errno));
+      for (size_t i = 0; i < w; i++) retire(i);
+      return false;
+    }
+  }
+
+  fprintf(stdout, "[PathTracer] Rendering %zu cells on %zu worker processes... ",
+          cells.size(), workers.size());
+  fflush(stdout);
+  renderStart = std::chrono::steady_clock::now();
+  Timer timer;
+  timer.start();
+
+  const int maxAttempts = 3;
+  size_t done = 0;
+  bool failed = false;
+  std::vector<CellPixel> pixels;
+  auto fail = [&](size_t w) {
+    long cell = workers[w].cell;
+    retire(w);
+    if (cell >= 0) {
+      if (++attempts[cell] >= maxAttempts) {
+        fprintf(stderr, "\n[PathTracer] Cell (%d, %d) failed %d times, giving up.\n",
+                cells[cell].x0, cells[cell].y0, maxAttempts);
+        failed = true;
+        return;
+      }
+      pending.push_front(cell);
+    }
+    fprintf(stderr, "\n[PathTracer] Worker process died, restarting it.\n");
+    spawn(w);
+    if (workers[w].pid < 0) failed = true;
+  };
+
+  while (done < cells.size() && !failed) {
+    for (size_t w = 0; w < workers.size() && !failed; w++) {
+      if (workers[w].cell >= 0 || pending.empty()) continue;
+      size_t cell = pending.front();
+      pending.pop_front();
+      workers[w].cell = cell;
+      double elapsed = elapsed_time();
+      const std::vector<long long>& budgets = cellTiles[cell];
+      if (!write_fully(workers[w].socket, &cells[cell], sizeof(Cell)) ||
+          !write_fully(workers[w].socket, &elapsed, sizeof(elapsed)) ||
+          !write_fully(workers[w].socket, budgets.data(), budgets.size() * sizeof(long long))) {
+        fail(w);
+      }
+    }
+    if (failed) break;
+
+    std::vector<pollfd> fds;
+    std::vector<size_t> busy;
+    for (size_t w = 0; w < workers.size(); w++) {
+      if (workers[w].cell < 0) continue;
+      pollfd fd = {workers[w].socket, POLLIN, 0};
+      fds.push_back(fd);
+      busy.push_back(w);
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      break;
+    }
+
+    for (size_t i = 0; i < fds.size() && !failed; i++) {
+      if (!fds[i].revents) continue;
+      size_t w = busy[i];
+      const Cell& cell = cells[workers[w].cell];
+      Cell header;
+      pixels.resize((cell.x1 - cell.x0) * (cell.y1 - cell.y0));
+      if (!read_fully(workers[w].socket, &header, sizeof(header)) ||
+          memcmp(&header, &cell, sizeof(Cell)) != 0 ||
+          !read_fully(workers[w].socket, pixels.data(), pixels.size() * sizeof(CellPixel))) {
+        fail(w);
+        continue;
+      }
+
+      const CellPixel* p = pixels.data();
+      for (int y = cell.y0; y < cell.y1; y++) {
+        for (int x = cell.x0; x < cell.x1; x++, p++) {
+          size_t index = x + y * frame_w;
+          pt->sampleBuffer.data[index] = p->radiance;
+          pt->albedoBuffer.data[index] = p->albedo;
+          pt->normalBuffer.data[index] = p->normal;
+          pt->depthBuffer[index] = p->depth;
+          pt->illumDeviationBuffer[index] = p->illum_deviation;
+          pt->sampleCountBuffer[index] = p->count;
+          if (pt->trackPrimitives) pt->primitiveBuffer[index] = p->primitive;
+        }
+      }
+      pt->write_to_framebuffer(frameBuffer, cell.x0, cell.y0, cell.x1, cell.y1);
+      workers[w].cell = -1;
+      done++;
+      fprintf(stdout, "\r[PathTracer] Rendering %zu cells on %zu worker processes... %d%%",
+              cells.size(), workers.size(), int(100.0 * done / cells.size()));
+      fflush(stdout);
+    }
+  }
+
+  // Workers exit once their socket is closed.
+  for (size_t w = 0; w < workers.size(); w++) {
+    if (workers[w].socket >= 0) close(workers[w].socket);
+    workers[w].socket = -1;
+  }
+  for (size_t w = 0; w < workers.size(); w++) {
+    if (workers[w].pid > 0) waitpid(workers[w].pid, NULL, 0);
+  }
+  signal(SIGPIPE, SIG_DFL);
+  timer.stop();
+  if (failed) {
+    fprintf(stderr, "[PathTracer] Distributed render failed.\n");
+    return false;
+  }
+
+  fprintf(stdout, "\r[PathTracer] Rendering %zu cells on %zu worker processes... 100%%! (%.4fs)\n",
+          cells.size(), workers.size(), timer.duration());
+  for (const auto& stat : render_stats()) {
+    fprintf(stdout, "[PathTracer] %s: %s\n", stat.first.c_str(), stat.second.c_str());
+  }
+  if (denoiseOutput) denoise_frame();
+  state = DONE;
+  return true;
+}
+
+#else
+
+void RaytracedRenderer::serve_cells(int socket) {}
+
+bool RaytracedRenderer::render_distributed() {
+  fprintf(stderr, "[PathTracer] Worker processes are not supported on this platform.\n");
+  return false;
+}
+
+#endif
+
 void RaytracedRenderer::build_accel() {
 
   // collect primitives //
@@ -369,6 +1041,19 @@ void RaytracedRenderer::build_accel() {
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
+  // Number primitives and their materials in scene order, which the BVH
+  // does not keep, so ids stay the same from one render to the next.
+  pt->primitiveIds.clear();
+  primitiveMaterials.clear();
+  if (pt->trackPrimitives) {
+    std::unordered_map<const BSDF*, uint32_t> materials;
+    for (size_t i = 0; i < primitives.size(); i++) {
+      pt->primitiveIds[primitives[i]] = i;
+      auto material = materials.insert(std::make_pair(primitives[i]->get_bsdf(), (uint32_t) materials.size()));
+      primitiveMaterials.push_back(material.first->second);
+    }
+  }
+
   // initial visualization //
   selectionHistory.push(bvh->get_root());
 }
@@ -581,6 +1266,13 @@ void RaytracedRenderer::key_press(int key) {
       fprintf(stdout, "[PathTracer] No longer in cell render mode.\n");
     break;
 
+  case 'x': case 'X':
+    if (state == RENDERING && samplesPerPass > 0) {
+      finishRequested = true;
+      fprintf(stdout, "\n[PathTracer] Finishing progressive render after the tiles in flight.\n");
+    }
+    break;
+
   case 'a': case 'A':
     show_rays = !show_rays;
   default:
@@ -590,33 +1282,319 @@ void RaytracedRenderer::key_press(int key) {
 
 /**
  * Raytrace a tile of the scene and update the frame buffer. Is run
- * in a worker thread.
+ * in a worker thread. Returns true if the tile should get another pass.
  */
-void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
-                               int tile_w, int tile_h) {
+bool RaytracedRenderer::raytrace_tile(WorkItem& work, size_t thread) {
   size_t w = frame_w;
   size_t h = frame_h;
 
-  size_t tile_start_x = tile_x;
-  size_t tile_start_y = tile_y;
+  size_t tile_start_x = work.tile_x;
+  size_t tile_start_y = work.tile_y;
 
-  size_t tile_end_x = std::min(tile_start_x + tile_w, w);
-  size_t tile_end_y = std::min(tile_start_y + tile_h, h);
+  size_t tile_end_x = std::min(tile_start_x + work.tile_w, w);
+  size_t tile_end_y = std::min(tile_start_y + work.tile_h, h);
 
-  size_t tile_idx_x = tile_x / imageTileSize;
-  size_t tile_idx_y = tile_y / imageTileSize;
-  size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
+  if (work.preview_scale > 1) {
+    preview_tile(work, thread);
+    return continueRaytracing;
+  }
 
+  // Every pixel first gets min_samples uniformly. With adaptive sampling on,
+  // pixels whose confidence interval is still wider than the tile's
+  // tolerance keep drawing from the image-wide budget, up to max_samples
+  // each. A time-budgeted render has no sample budget: it samples until the
+  // deadline, and only retires a tile early once none of its pixels is
+  // noisy at all.
+  bool budgeted = timeBudget > 0;
+  bool adaptive = pt->maxTolerance > 0 || budgeted;
+  size_t pass = pass_size();
+  size_t min_samples = adaptive ? std::min(pt->samplesPerBatch, pt->ns_aa) : pt->ns_aa;
+  size_t max_samples = budgeted ? std::numeric_limits<int>::max()
+                     : adaptive ? pt->ns_aa * adaptiveMaxRate : pt->ns_aa;
+
+  auto budget_left = [&]() {
+    return reproducible ? work.budget > 0 : samplesRemaining > 0;
+  };
+
+  bool needs_more = false;
+  bool stopped = false;
+  bool split = false;
+  bool filled = true;     // every pixel has min_samples after the pass
+  double max_error = 0;   // of the pixels past min_samples
+  size_t traced = 0;
   for (size_t y = tile_start_y; y < tile_end_y; y++) {
-    if (!continueRaytracing) return;
+    if (!continueRaytracing) return false;
+    if (stopped && work.filled) break;
+
+    // Once the queue runs dry, a worker stuck on an expensive tile holds up
+    // the end of the frame while the others idle. Hand the lower half of
+    // the rows left over to them as a tile of its own, once a pass: the
+    // idle workers only notice the new tile after this check. Where the
+    // split falls depends on timing, so reproducible renders keep whole
+    // tiles.
+    if (!split && idleWorkers > 0 && !reproducible && tile_end_y - y >= 2 * minSplitRows) {
+      split = true;
+      size_t slot = tileCount++;
+      if (slot < tiles.size()) {
+        size_t mid = y + (tile_end_y - y) / 2;
+        WorkItem& rest = tiles[slot];
+        rest = work;
+        rest.tile_y = mid;
+        rest.tile_h = tile_end_y - mid;
+        work.tile_h = mid - tile_start_y;
+        tile_end_y = mid;
+        if (budgeted && !rest.filled) tilesUnderMin++;
+        tilesActive++;
+        workQueue.put_work(thread, slot);
+        wake_idle_workers();
+      }
+    }
+
     for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      pt->raytrace_pixel(x, y);
+      // Pixels are the unit of accumulation, so a deadline can cut a pass
+      // short at any pixel and still leave a consistent image. Pixels short
+      // of min_samples still get them, so none is left black.
+      if (budgeted && !stopped && progressive_done()) stopped = true;
+
+      size_t count = pt->sampleCountBuffer[x + y * w];
+      size_t n = 0;
+      if (count < min_samples) {
+        n = stopped ? min_samples - count : std::min(pass, min_samples - count);
+      } else if (!stopped && adaptive && count < max_samples && (budgeted || budget_left())) {
+        double error = pt->pixel_error(x, y);
+        if (error > work.tolerance) {
+          n = std::min(pass, max_samples - count);
+        } else {
+          max_error = std::max(max_error, error);
+        }
+      }
+      if (n == 0) continue;
+
+      pt->raytrace_pixel(x, y, n, thread);
+      samplesRemaining -= n;
+      work.budget -= n;
+      traced += n;
+
+      count += n;
+      if (count < min_samples) {
+        filled = false;
+        needs_more = true;
+      } else if (adaptive && count < max_samples) {
+        double error = pt->pixel_error(x, y);
+        max_error = std::max(max_error, error);
+        if (error > work.tolerance) needs_more = true;
+      }
     }
   }
 
-  tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] += 1;
+  // The workers keep going past the deadline while any tile is short of
+  // min_samples.
+  if (budgeted && filled && !work.filled) {
+    work.filled = true;
+    tilesUnderMin--;
+  }
+
+  if (traced > 0) {
+    if (checkpointFile != "" && !render_cell) {
+      checkpoint.capture(*pt, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+    }
+    pt->write_to_framebuffer(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  }
+
+  if (budgeted) {
+    if (stopped) return !filled;
+    // Spare time goes to whatever is noisiest: once every pixel of the tile
+    // meets its tolerance, halve the tolerance and keep going. Pixels that
+    // come out the same every sample meet any tolerance, so a tile of only
+    // those is done.
+    if (!needs_more) {
+      if (max_error == 0) return false;
+      work.tolerance *= 0.5;
+    }
+    return true;
+  }
+  return needs_more && budget_left();
+}
+
+void RaytracedRenderer::preview_tile(WorkItem& work, size_t thread) {
+  size_t w = frame_w;
+  size_t h = frame_h;
+  size_t scale = work.preview_scale;
+  size_t tile_end_x = std::min((size_t) work.tile_x + work.tile_w, w);
+  size_t tile_end_y = std::min((size_t) work.tile_y + work.tile_h, h);
+
+  // Blocks are aligned to the pixel that fills them, so each coarser pass
+  // traces a subset of the pixels of the next and no sample is wasted.
+  for (size_t y = work.tile_y; y < tile_end_y; y += scale) {
+    if (!continueRaytracing) return;
+    for (size_t x = work.tile_x; x < tile_end_x; x += scale) {
+      size_t index = x + y * w;
+      if (pt->sampleCountBuffer[index] == 0) {
+        pt->raytrace_pixel(x, y, 1, thread);
+        samplesRemaining--;
+        work.budget--;
+      }
+      pt->write_to_framebuffer(frameBuffer, x, y, x + 1, y + 1);
+      uint32_t color = frameBuffer.data[index];
+      for (size_t by = y; by < std::min(y + scale, tile_end_y); by++) {
+        for (size_t bx = x; bx < std::min(x + scale, tile_end_x); bx++) {
+          if (!reprojected[bx + by * w]) frameBuffer.data[bx + by * w] = color;
+        }
+      }
+    }
+  }
+  work.preview_scale /= 2;
+}
+
+void RaytracedRenderer::camera_moved() {
+  if (!interactive || render_cell || state != READY || frameBuffer.w == 0) return;
+  reproject_frame();
+  reprojectPending = true;
+  start_raytracing();
+}
+
+void RaytracedRenderer::reproject_frame() {
+  size_t w = frame_w;
+  size_t h = frame_h;
+  ImageBuffer previous = frameBuffer;
+  std::vector<double> distance(w * h, INF_D);
+  Vector3D eye = camera->position();
+
+  frameBuffer.clear();
+  reprojected.assign(w * h, 0);
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t i = x + y * w;
+      if (pt->sampleCountBuffer[i] == 0 || pt->depthBuffer[i] >= previewCamera.far_clip()) continue;
+
+      // The depth is averaged over the pixel's samples, so along the ray
+      // through the pixel center it lands close to the surfaces they hit.
+      Ray r = previewCamera.generate_ray((x + 0.5) / w, (y + 0.5) / h);
+      Vector3D p = r.o + r.d * pt->depthBuffer[i];
+      Vector2D xy;
+      if (!camera->project(p, &xy)) continue;
+      size_t j = min((size_t) (xy.x * w), w - 1) + min((size_t) (xy.y * h), h - 1) * w;
+      double d = (p - eye).norm();
+      if (d < distance[j]) {
+        distance[j] = d;
+        frameBuffer.data[j] = previous.data[i];
+        reprojected[j] = 1;
+      }
+    }
+  }
+}
+
+size_t RaytracedRenderer::pass_size() const {
+  if (samplesPerPass > 0) return samplesPerPass;
+  if (pt->maxTolerance > 0 || timeBudget > 0) return std::max(pt->samplesPerBatch, (size_t)1);
+  return pt->ns_aa;
+}
+
+void RaytracedRenderer::add_frame_stats(FrameStats& totals) const {
+  size_t x0 = 0, y0 = 0, x1 = frame_w, y1 = frame_h;
+  if (render_cell) {
+    x0 = cell_tl.x; y0 = cell_tl.y;
+    x1 = cell_br.x; y1 = cell_br.y;
+  }
+
+  // Noise is the mean over pixels of the relative 95% confidence interval;
+  // pixels with fewer than two samples have no estimate and are skipped.
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      int count = pt->sampleCountBuffer[x + y * frame_w];
+      totals.total_spp += count;
+      totals.min_spp = std::min(totals.min_spp, count);
+      totals.max_spp = std::max(totals.max_spp, count);
+      totals.pixels++;
+
+      double error = pt->pixel_error(x, y);
+      if (error < INF_D) {
+        totals.total_error += error;
+        totals.noise_pixels++;
+      }
+    }
+  }
+
+  // A reproducible render is identified by its exact radiance values, so
+  // runs on different machines and thread counts can be checked against
+  // each other (FNV-1a over the sample buffer).
+  if (reproducible) {
+    for (size_t y = y0; y < y1; y++) {
+      const unsigned char* bytes = (const unsigned char*) &pt->sampleBuffer.data[x0 + y * frame_w];
+      for (size_t i = 0; i < (x1 - x0) * sizeof(FloatRGB); i++) {
+        totals.hash = (totals.hash ^ bytes[i]) * 0x100000001b3ULL;
+      }
+    }
+  }
+}
+
+std::vector<std::pair<std::string, std::string>> RaytracedRenderer::render_stats() const {
+  FrameStats totals;
+  if (streaming) {
+    totals = streamTotals;
+  } else {
+    add_frame_stats(totals);
+  }
+  if (totals.pixels == 0) return {};
+
+  char buf[64];
+  std::vector<std::pair<std::string, std::string>> stats;
+  snprintf(buf, sizeof(buf), "%.2f (min %d, max %d)", totals.total_spp / totals.pixels,
+           totals.min_spp, totals.max_spp);
+  stats.push_back(std::make_pair("Samples per pixel", std::string(buf)));
+  if (totals.noise_pixels > 0) {
+    snprintf(buf, sizeof(buf), "%.4f", totals.total_error / totals.noise_pixels);
+    stats.push_back(std::make_pair("Relative error (95% CI)", std::string(buf)));
+  }
+  double time = elapsed_time();
+  snprintf(buf, sizeof(buf), "%.3f", time);
+  stats.push_back(std::make_pair("Render time (s)", std::string(buf)));
+
+  // Efficiency is inverse relative variance per second, so renders of the
+  // same scene can be compared regardless of how long each one ran.
+  if (totals.noise_pixels > 0 && totals.total_error > 0) {
+    double error = totals.total_error / totals.noise_pixels;
+    snprintf(buf, sizeof(buf), "%.4g", 1 / (error * error * time));
+    stats.push_back(std::make_pair("Efficiency (1/(error^2 s))", std::string(buf)));
+  }
+  if (pathGuiding) {
+    snprintf(buf, sizeof(buf), "%zu", pathGuide.generations());
+    stats.push_back(std::make_pair("Path guide generations", std::string(buf)));
+  }
+  std::shared_ptr<const PhotonMap> causticMap = std::atomic_load(&pt->causticMap);
+  if (causticMap) {
+    snprintf(buf, sizeof(buf), "%zu (radius %.4g)", causticMap->size(), causticMap->radius());
+    stats.push_back(std::make_pair("Caustic photons", std::string(buf)));
+  }
+  if (irradianceCacheError > 0 && irradianceCache.num_lookups() > 0) {
+    snprintf(buf, sizeof(buf), "%zu (%.2f%% of lookups traced)",
+             irradianceCache.num_records(),
+             100.0 * irradianceCache.num_misses() / irradianceCache.num_lookups());
+    stats.push_back(std::make_pair("Irradiance cache records", std::string(buf)));
+  }
+
+  if (reproducible) {
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) totals.hash);
+    stats.push_back(std::make_pair("Image checksum", std::string(buf)));
+  }
+  return stats;
+}
+
+double RaytracedRenderer::elapsed_time() const {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - renderStart).count();
+}
+
+int RaytracedRenderer::progress_percent() const {
+  if (timeBudget > 0)
+    return std::min(int(elapsed_time() / timeBudget * 100), 100);
+  long long remaining = std::max(samplesRemaining.load(), 0LL);
+  return int((double)(samplesTotal - remaining) / samplesTotal * 100);
+}
 
-  pt->write_to_framebuffer(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+bool RaytracedRenderer::progressive_done() const {
+  if (finishRequested) return true;
+  return timeBudget > 0 && elapsed_time() >= timeBudget;
 }
 
 void RaytracedRenderer::raytrace_cell(ImageBuffer& buffer) {
@@ -651,35 +1629,277 @@ void RaytracedRenderer::autofocus(Vector2D loc) {
   pt->autofocus(loc);
 }
 
-void RaytracedRenderer::worker_thread() {
+void RaytracedRenderer::denoise_frame() {
+  size_t x0 = 0, y0 = 0, x1 = frame_w, y1 = frame_h;
+  if (render_cell) {
+    x0 = cell_tl.x; y0 = cell_tl.y;
+    x1 = cell_br.x; y1 = cell_br.y;
+  }
+
+  fprintf(stdout, "[PathTracer] Denoising... "); fflush(stdout);
+  Timer timer;
+  timer.start();
+  Denoiser denoiser(workerPool.get());
+  HDRImageBuffer denoised;
+  denoiser.denoise(*pt, denoised, x0, y0, x1, y1);
+  denoised.toColor(frameBuffer, pt->colorEncoder, x0, y0, x1, y1, workerPool.get());
+  timer.stop();
+  fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+}
 
+void RaytracedRenderer::build_caustic_map(double radius, size_t k) {
   Timer timer;
   timer.start();
 
-  WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
-    raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-    { 
+  size_t chunks = std::max(numWorkerThreads, (size_t)1);
+  causticChunks.assign(chunks, std::vector<Photon>());
+  causticEmitted.assign(chunks, 0);
+  causticChunkNext = chunks;
+  workerPool->for_each(chunks, [this](size_t chunk) { trace_caustic_chunk(chunk); });
+  publish_caustic_map(radius, k);
+  timer.stop();
+
+  std::shared_ptr<const PhotonMap> map = std::atomic_load(&pt->causticMap);
+  fprintf(stdout, "[PathTracer] Traced %zu caustic photons from %zu emitted (%.4f sec)\n",
+          map->size(), map->emitted(), timer.duration());
+}
+
+void RaytracedRenderer::trace_caustic_chunk(size_t chunk) {
+  size_t chunks = causticChunks.size();
+  size_t count = causticPhotons * (chunk + 1) / chunks - causticPhotons * chunk / chunks;
+  causticChunks[chunk].clear();
+  causticEmitted[chunk] = pt->trace_caustic_photons(count, &causticChunks[chunk]);
+}
+
+void RaytracedRenderer::publish_caustic_map(double radius, size_t k) {
+  size_t emitted = 0;
+  std::vector<Photon> all;
+  for (size_t chunk = 0; chunk < causticChunks.size(); chunk++) {
+    emitted += causticEmitted[chunk];
+    all.insert(all.end(), causticChunks[chunk].begin(), causticChunks[chunk].end());
+  }
+  // Gathers still running on the previous map hold their own reference to
+  // it, so it is freed once the last of them is done.
+  std::shared_ptr<const PhotonMap> map = std::make_shared<PhotonMap>(all, emitted, radius, k);
+  std::atomic_store(&pt->causticMap, map);
+}
+
+void RaytracedRenderer::update_caustic_map() {
+  if (causticPhotons == 0 || samplesPerPass == 0) return;
+
+  if (!causticBuilding) {
+    size_t num_pixels = samplesTotal / pt->ns_aa;
+    long long spent = (long long) samplesTotal - samplesRemaining;
+    size_t pass = std::max(spent, 0LL) / (num_pixels * samplesPerPass);
+    if (pass <= causticPass || !causticLock.try_lock()) return;
+
+    // Progressive photon mapping (Knaus and Zwicker 2011): averaging passes
+    // whose squared radius shrinks by (i + alpha) / (i + 1) makes both the
+    // noise and the blur of the averaged estimate vanish.
+    if (pass > causticPass && !causticBuilding) {
+      const double alpha = 2.0 / 3.0;
+      double r = std::atomic_load(&pt->causticMap)->radius();
+      double r2 = r * r;
+      for (size_t i = causticPass + 1; i <= pass; i++) r2 *= (i + alpha) / (i + 1);
+      causticPass = pass;
+      causticRadius = sqrt(r2);
+      causticChunksDone = 0;
+      causticChunkNext = 0;
+      causticBuilding = true;
+    }
+    causticLock.unlock();
+  }
+
+  // Chunks are claimed before their count is checked, so once they run out
+  // the counter just keeps going past the end until the next rebuild.
+  size_t chunks = causticChunks.size();
+  size_t chunk = causticChunkNext++;
+  if (chunk >= chunks) return;
+  trace_caustic_chunk(chunk);
+  if (++causticChunksDone == chunks) {
+    publish_caustic_map(causticRadius, 0);
+    causticBuilding = false;
+  }
+}
+
+void RaytracedRenderer::stop_checkpointing() {
+  if (!checkpointThread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lk(checkpointLock);
+    checkpointRunning = false;
+  }
+  checkpointWake.notify_all();
+  checkpointThread.join();
+}
+
+namespace {
+
+/**
+ * FNV-1a hash of a sequence of values, fed in one at a time.
+ */
+struct SettingsHash {
+  uint64_t value;
+  SettingsHash() : value(0xcbf29ce484222325ULL) {}
+  void add(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) value = (value ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  void add(uint64_t v) { add(&v, sizeof(v)); }
+  void add(double v) { add(&v, sizeof(v)); }
+  void add(const Vector3D& v) { add(v.x); add(v.y); add(v.z); }
+  void add(const string& s) { add((uint64_t) s.size()); add(s.data(), s.size()); }
+};
+
+}  // namespace
+
+uint64_t RaytracedRenderer::checkpoint_settings() const {
+  SettingsHash hash;
+
+  // A re-exported scene keeps its path, so its timestamp and size count too.
+  hash.add(sceneFile);
+  struct stat st;
+  if (!sceneFile.empty() && stat(sceneFile.c_str(), &st) == 0) {
+    hash.add((uint64_t) st.st_mtime);
+    hash.add((uint64_t) st.st_size);
+  }
+
+  hash.add(camera->position());
+  hash.add(camera->view_point());
+  hash.add(camera->up_dir());
+  hash.add(camera->v_fov());
+  hash.add(camera->aspect_ratio());
+  hash.add(camera->near_clip());
+  hash.add(camera->far_clip());
+  hash.add(camera->lensRadius);
+  hash.add(camera->focalDistance);
+
+  hash.add((uint64_t) pt->ns_aa);
+  hash.add((uint64_t) pt->max_ray_depth);
+  hash.add((uint64_t) pt->ns_area_light);
+  hash.add((uint64_t) pt->samplesPerBatch);
+  hash.add(pt->maxTolerance);
+  hash.add((uint64_t) pt->direct_hemisphere_sample);
+  hash.add((uint64_t) pt->sampleSequence);
+  hash.add((uint64_t) pt->seed);
+  hash.add((uint64_t) samplesPerPass);
+  hash.add((uint64_t) adaptiveMaxRate);
+  hash.add((uint64_t) pathGuiding);
+  hash.add(irradianceCacheError);
+  hash.add((uint64_t) causticPhotons);
+  hash.add((uint64_t) bidirectional);
+  hash.add((uint64_t) reproducible);
+  hash.add((uint64_t) aovPasses);
+  return hash.value;
+}
+
+void RaytracedRenderer::wake_idle_workers() {
+  if (idleWorkers == 0) return;
+  // Taking the lock orders the notification after a waiter's check of the
+  // queue, so the wakeup cannot slip in between.
+  lock_guard<std::mutex> lk(workLock);
+  workReady.notify_all();
+}
+
+void RaytracedRenderer::worker_thread(size_t thread) {
+
+  Timer timer;
+  timer.start();
+
+  // A tile that still needs samples after its pass goes back to the end of
+  // the queue, so the image is swept in passes and refines as a whole.
+  // Workers that find the queue empty wait for the tiles in flight, which
+  // may come back for another pass.
+  int idx;
+  bool idle = false;
+  while (continueRaytracing && tilesActive > 0 &&
+         (!progressive_done() || tilesUnderMin > 0)) {
+    if (!workQueue.try_get_work(thread, &idx)) {
+      if (!idle) idleWorkers++;
+      idle = true;
+      // Sleep until a tile comes back or the last one retires. The timeout
+      // covers the deadline of a time-budgeted render, which nothing
+      // signals.
+      unique_lock<std::mutex> lk(workLock);
+      workReady.wait_for(lk, std::chrono::milliseconds(20), [this]() {
+        return !workQueue.is_empty() || tilesActive == 0 || !continueRaytracing;
+      });
+      continue;
+    }
+    if (idle) idleWorkers--;
+    idle = false;
+    WorkItem& work = tiles[idx];
+    update_caustic_map();
+    if (raytrace_tile(work, thread) && continueRaytracing) {
+      workQueue.put_work(thread, idx);
+    } else {
+      tilesActive--;
+    }
+    wake_idle_workers();
+
+    // Workers only take the lock to print when the percentage moves on.
+    int percent = progress_percent();
+    if (percent > progressShown) {
       lock_guard<std::mutex> lk(m_done);
-      ++tilesDone;
-      cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
-      cout.flush();
+      if (percent > progressShown) {
+        progressShown = percent;
+        fprintf(stdout, "\r[PathTracer] Rendering... %d%%", percent);
+        fflush(stdout);
+      }
     }
   }
 
-  workerDoneCount++;
-  if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
+  int finished = ++workerDoneCount;
+  if (!continueRaytracing && finished == numWorkerThreads) {
     timer.stop();
     fprintf(stdout, "\n[PathTracer] Rendering canceled!\n");
+    if (checkpointThread.joinable()) {
+      stop_checkpointing();
+      if (checkpoint.save(checkpointFile, elapsed_time())) {
+        fprintf(stdout, "[PathTracer] Saved checkpoint %s\n", checkpointFile.c_str());
+      }
+    }
     state = READY;
   }
 
-  if (continueRaytracing && workerDoneCount == numWorkerThreads) {
+  if (continueRaytracing && finished == numWorkerThreads) {
     timer.stop();
-    fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
+    if (timeBudget > 0) {
+      fprintf(stdout, "\r[PathTracer] Rendering... time budget reached. (%.4fs)\n", timer.duration());
+    } else if (progressive_done()) {
+      fprintf(stdout, "\r[PathTracer] Rendering stopped at %d%% of the sample budget. (%.4fs)\n",
+              progress_percent(), timer.duration());
+    } else {
+      fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
+    }
     fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
     fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)bvh->total_rays / timer.duration() * 1e-6);
     fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    // A streamed render reports its stats once every band is done.
+    if (!streaming) {
+      for (const auto& stat : render_stats()) {
+        fprintf(stdout, "[PathTracer] %s: %s\n", stat.first.c_str(), stat.second.c_str());
+      }
+    }
+
+    // The image is complete, so there is nothing left to resume.
+    if (checkpointThread.joinable()) {
+      stop_checkpointing();
+      remove(checkpointFile.c_str());
+    }
+
+    // Light tracing lands anywhere in the image, so it is only added once
+    // every tile is done.
+    if (bidirectional) {
+      size_t x0 = 0, y0 = 0, x1 = frame_w, y1 = frame_h;
+      if (render_cell) {
+        x0 = cell_tl.x; y0 = cell_tl.y;
+        x1 = cell_br.x; y1 = cell_br.y;
+      }
+      bdpt.resolve(x0, y0, x1, y1);
+      pt->write_to_framebuffer(frameBuffer, x0, y0, x1, y1, workerPool.get());
+    }
+
+    if (denoiseOutput) denoise_frame();
 
     lock_guard<std::mutex> lk(m_done);
     state = DONE;
@@ -706,35 +1926,74 @@ void RaytracedRenderer::save_image(string filename, ImageBuffer* buffer) {
     filename = ss.str();  
   }
 
-  uint32_t* frame = &buffer->data[0];
+  // The writer gets its own copy of the pixels and stats, so the next
+  // render can reuse the frame buffer while this one compresses.
+  fprintf(stderr, "[PathTracer] Saving to file: %s\n", filename.c_str());
+  auto pixels = std::make_shared<std::vector<uint32_t>>(flip_rows(*buffer));
+  auto stats = render_stats();
   size_t w = buffer->w;
   size_t h = buffer->h;
-  uint32_t* frame_out = new uint32_t[w * h];
-  for(size_t i = 0; i < h; ++i) {
-    memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
-  }
-  
-  for (size_t i = 0; i < w * h; ++i) {
-    frame_out[i] |= 0xFF000000;
+  imageWriter.push([=]() {
+    std::vector<unsigned char> png;
+    encode_png(png, *pixels, w, h, stats);
+    if (lodepng::save_file(png, filename)) {
+      fprintf(stderr, "[PathTracer] Could not write %s\n", filename.c_str());
+    } else {
+      fprintf(stderr, "[PathTracer] Saved %s\n", filename.c_str());
+    }
+  });
+
+  save_sampling_rate_image(filename);
+  if (aovPasses && buffer == &frameBuffer) save_aov_image(filename);
+}
+
+void RaytracedRenderer::wait_for_writes() {
+  imageWriter.wait();
+}
+
+std::vector<uint32_t> RaytracedRenderer::flip_rows(const ImageBuffer& buffer) {
+  size_t w = buffer.w;
+  size_t h = buffer.h;
+  std::vector<uint32_t> pixels(w * h);
+  // Flip the rows and make the pixels opaque in one pass.
+  for (size_t i = 0; i < h; ++i) {
+    const uint32_t* in = &buffer.data[(h - i - 1) * w];
+    uint32_t* out = &pixels[i * w];
+    for (size_t x = 0; x < w; ++x) out[x] = in[x] | 0xFF000000;
   }
+  return pixels;
+}
 
-  fprintf(stderr, "[PathTracer] Saving to file: %s... ", filename.c_str());
-  lodepng::encode(filename, (unsigned char*) frame_out, w, h);
-  fprintf(stderr, "Done!\n");
-  
-  delete[] frame_out;
+void RaytracedRenderer::encode_png(std::vector<unsigned char>& png, const std::vector<uint32_t>& pixels,
+                                   size_t w, size_t h,
+                                   const std::vector<std::pair<std::string, std::string>>& stats) {
+  // Record how far the render got alongside the pixels, so time-budgeted
+  // frames can be compared by their achieved sample rate and noise level.
+  lodepng::State png_state;
+  png_state.encoder.text_compression = 0;
+  for (const auto& stat : stats) {
+    lodepng_add_text(&png_state.info_png, stat.first.c_str(), stat.second.c_str());
+  }
 
-  save_sampling_rate_image(filename);
+  lodepng::encode(png, (const unsigned char*) pixels.data(), w, h, png_state);
 }
 
 void RaytracedRenderer::save_sampling_rate_image(string filename) {
   size_t w = frameBuffer.w;
   size_t h = frameBuffer.h;
-  ImageBuffer outputBuffer(w, h);
+  // Filled now, since the next render clears the sample counts.
+  auto outputBuffer = std::make_shared<ImageBuffer>(w, h);
+
+  // Adaptive sampling may spend more than ns_aa on a pixel, so the rates
+  // are relative to the most sampled pixel, which shows red.
+  int max_count = 1;
+  for (size_t i = 0; i < w * h; i++) {
+    max_count = std::max(max_count, (int) pt->sampleCountBuffer[i]);
+  }
 
   for (int x = 0; x < w; x++) {
       for (int y = 0; y < h; y++) {
-          float samplingRate = pt->sampleCountBuffer[y * w + x] * 1.0f / pt->ns_aa;
+          float samplingRate = pt->sampleCountBuffer[y * w + x] * 1.0f / max_count;
 
           Color c;
           if (samplingRate <= 0.5) {
@@ -744,20 +2003,36 @@ void RaytracedRenderer::save_sampling_rate_image(string filename) {
               float r = (1.0 - samplingRate) / 0.5;
               c = Color(0.0f, 1.0f, 0.0f) * r + Color(1.0f, 0.0f, 0.0f) * (1.0 - r);
           }
-          outputBuffer.update_pixel(c, x, h - 1 - y);
+          outputBuffer->update_pixel(c, x, h - 1 - y);
       }
   }
-  uint32_t* frame_out = new uint32_t[w * h];
-  
-  for (size_t i = 0; i < w * h; ++i) {
-    uint32_t out_color_hex = 0;
-    frame_out[i] = outputBuffer.data.data()[i];
-    frame_out[i] |= 0xFF000000;
-  }
+  // update_pixel has already flipped the rows and made the pixels opaque.
+  string rate_filename = filename.substr(0,filename.size()-4) + "_rate.png";
+  imageWriter.push([=]() {
+    if (lodepng::encode(rate_filename, (const unsigned char*) outputBuffer->data.data(), w, h)) {
+      fprintf(stderr, "[PathTracer] Could not write %s\n", rate_filename.c_str());
+    }
+  });
+}
 
-  lodepng::encode(filename.substr(0,filename.size()-4) + "_rate.png", (unsigned char*) frame_out, w, h);
-  
-  delete[] frame_out;
+void RaytracedRenderer::save_aov_image(string filename) {
+  // Filled now, since the next render clears the buffers.
+  auto values = exr_pixels();
+  auto channels = exr_channels();
+  size_t w = pt->sampleBuffer.w;
+  size_t h = pt->sampleBuffer.h;
+  size_t tile_size = imageTileSize;
+  string exr_filename = filename.substr(0,filename.size()-4) + ".exr";
+  imageWriter.push([=]() {
+    TiledExrWriter exr;
+    bool ok = exr.open(exr_filename, w, h, tile_size, channels) &&
+              exr.add_rows(0, h, values->data());
+    if (!exr.close() || !ok) {
+      fprintf(stderr, "[PathTracer] Could not write %s\n", exr_filename.c_str());
+    } else {
+      fprintf(stderr, "[PathTracer] Saved %s\n", exr_filename.c_str());
+    }
+  });
 }
 
 }  // namespace CGL
@@ -4,10 +4,13 @@
 #include <stack>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <vector>
+#include <memory>
 #include <algorithm>
+#include <limits>
 
 #include "CGL/timer.h"
 
@@ -16,7 +19,11 @@
 #include "pathtracer/sampler.h"
 #include "util/image.h"
 #include "util/work_queue.h"
+#include "util/thread_pool.h"
+#include "util/image_writer.h"
+#include "util/tiled_exr.h"
 #include "pathtracer/intersection.h"
+#include "pathtracer/checkpoint.h"
 
 #include "application/renderer.h"
 
@@ -30,24 +37,48 @@ using CGL::SceneObjects::BVHNode;
 using CGL::SceneObjects::BVHAccel;
 
 #include "pathtracer.h"
+#include "denoiser.h"
 
 namespace CGL {
 
 struct WorkItem {
 
   // Default constructor.
-  WorkItem() : WorkItem(0, 0, 0, 0) { }
+  WorkItem() : WorkItem(0, 0, 0, 0, 0) { }
 
-  WorkItem(int x, int y, int w, int h)
-      : tile_x(x), tile_y(y), tile_w(w), tile_h(h) {}
+  WorkItem(int x, int y, int w, int h, double tol, long long budget = 0)
+      : tile_x(x), tile_y(y), tile_w(w), tile_h(h),
+        tolerance(tol), budget(budget), preview_scale(1), filled(false) {}
 
   int tile_x;
   int tile_y;
   int tile_w;
   int tile_h;
+  double tolerance;  ///< relative error the tile's adaptive pixels aim for
+  long long budget;  ///< samples left to the tile in a reproducible render
+  int preview_scale; ///< side of the blocks the next pass fills from one pixel (1 = full resolution)
+  bool filled;       ///< every pixel has its minimum samples
 
 };
 
+/**
+ * Per-pixel totals the render stats are made of, which add up over the
+ * bands of a streamed render.
+ */
+struct FrameStats {
+
+  FrameStats()
+      : pixels(0), noise_pixels(0), min_spp(std::numeric_limits<int>::max()),
+        max_spp(0), total_spp(0), total_error(0), hash(0xcbf29ce484222325ULL) {}
+
+  size_t pixels;
+  size_t noise_pixels;   ///< pixels with a noise estimate
+  int min_spp, max_spp;
+  double total_spp;
+  double total_error;    ///< sum of the pixels' relative 95% confidence intervals
+  uint64_t hash;         ///< FNV-1a over the radiance of the rows so far, bottom-up
+};
+
 /**
  * A pathtracer with BVH accelerator and BVH visualization capabilities.
  * It is always in exactly one of the following states:
@@ -74,7 +105,24 @@ public:
              bool direct_hemisphere_sample = false,
              string filename = "",
              double lensRadius = 0.25,
-             double focalDistance = 4.7);
+             double focalDistance = 4.7,
+             size_t samples_per_pass = 0,
+             double time_budget = 0,
+             bool denoise = false,
+             bool path_guiding = false,
+             double irradiance_cache_error = 0,
+             size_t caustic_photons = 0,
+             bool bidirectional = false,
+             SampleSequence sample_sequence = SEQUENCE_RANDOM,
+             long long seed = -1,
+             size_t worker_processes = 0,
+             string checkpoint_file = "",
+             double checkpoint_interval = 60,
+             bool interactive = false,
+             bool stream_exr = false,
+             int aov_passes = 0,
+             string scene_file = "",
+             std::shared_ptr<ThreadPool> thread_pool = nullptr);
 
   /**
    * Destructor.
@@ -92,8 +140,8 @@ public:
   void set_scene(Scene* scene);
 
   /**
-   * If in the INIT state, configures the pathtracer to use the given camera. If
-   * configuration is done, transitions to the READY state.
+   * Configures the pathtracer to use the given camera, stopping a running
+   * render first. If configuration is done, transitions to the READY state.
    * This DOES NOT take ownership of the camera, and doesn't delete it ever.
    * \param camera the camera to use in rendering
    */
@@ -146,21 +194,41 @@ public:
 
   void raytrace_cell(ImageBuffer& buffer);
 
+  std::vector<std::pair<std::string, std::string>> render_to_png(
+      std::vector<unsigned char>& png, size_t x, size_t y, size_t dx, size_t dy);
+
+  void set_samples_per_pixel(size_t ns_aa);
+
+  /**
+   * In an interactive render stopped to move the camera, reproject what had
+   * been rendered into the view of the moved camera and start over from there.
+   */
+  void camera_moved();
+
   /**
    * If the pathtracer is in VISUALIZE, handle key presses to traverse the bvh.
    */
   void key_press(int key);
 
   /**
-   * Save rendered result to png file.
+   * Save rendered result to png file. The file is encoded and written in
+   * the background; wait_for_writes() waits for it.
    */
   void save_image(std::string filename="", ImageBuffer* buffer=NULL);
 
   /**
-   * Save sampling rates to png file.
+   * Save sampling rates to png file, in the background as well.
    */
   void save_sampling_rate_image(std::string filename);
 
+  /**
+   * Save the linear image and the AOV passes to a multi-channel EXR named
+   * after the png file, in the background as well.
+   */
+  void save_aov_image(std::string filename);
+
+  void wait_for_writes();
+
  private:
 
   /**
@@ -181,15 +249,163 @@ public:
   void visualize_cell() const;
 
   /**
-   * Raytrace a tile of the scene and update the frame buffer. Is run
-   * in a worker thread.
+   * Raytrace one pass over a tile of the scene and update the frame buffer.
+   * Is run in a worker thread. Returns true if some pixel of the tile still
+   * needs samples, in which case the caller requeues the tile.
+   */
+  bool raytrace_tile(WorkItem& work, size_t thread);
+
+  /**
+   * One coarse pass of an interactive render over a tile: trace a sample
+   * for each block of work.preview_scale pixels that has none yet, fill the
+   * block with it, and halve the block size.
+   */
+  void preview_tile(WorkItem& work, size_t thread);
+
+  /**
+   * Samples per pixel traced by one pass over a tile.
+   */
+  size_t pass_size() const;
+
+  /**
+   * Percentage of the sample budget spent so far.
+   */
+  int progress_percent() const;
+
+  /**
+   * The buffer's pixels in top-down rows, opaque, as PNG encoding wants them.
+   */
+  static std::vector<uint32_t> flip_rows(const ImageBuffer& buffer);
+
+  /**
+   * Encode top-down pixels as PNG with the stats as text chunks.
+   */
+  static void encode_png(std::vector<unsigned char>& png, const std::vector<uint32_t>& pixels,
+                         size_t w, size_t h,
+                         const std::vector<std::pair<std::string, std::string>>& stats);
+
+  /**
+   * Per-render statistics (achieved samples per pixel, estimated noise)
+   * that are printed and stored in the saved image's metadata.
+   */
+  std::vector<std::pair<std::string, std::string>> render_stats() const;
+
+  /**
+   * Add the pixels of the rendered region to the totals.
+   */
+  void add_frame_stats(FrameStats& totals) const;
+
+  /**
+   * Seconds elapsed since the current render was started.
+   */
+  double elapsed_time() const;
+
+  /**
+   * True once a progressive render should stop issuing new passes, either
+   * because the time budget ran out or because the user asked to finish.
+   */
+  bool progressive_done() const;
+
+  /**
+   * Run the denoiser over the rendered region and show its result in the
+   * frame buffer. The accumulated samples are left untouched.
    */
-  void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+  void denoise_frame();
+
+  /**
+   * Trace caustic photons on the worker pool and publish them to the path
+   * tracer as a map with the given gather radius and neighbor count.
+   */
+  void build_caustic_map(double radius, size_t k);
+
+  /**
+   * Trace the photons of one chunk of the next caustic map.
+   */
+  void trace_caustic_chunk(size_t chunk);
+
+  /**
+   * Merge the traced chunks into a map with the given gather radius and
+   * neighbor count, and hand it to the path tracer.
+   */
+  void publish_caustic_map(double radius, size_t k);
+
+  /**
+   * In a progressive render, replace the caustic map with fresh photons and
+   * a smaller radius once per pass over the image. Called by the workers
+   * between tiles: each one that comes by traces a chunk of the photons
+   * while the rest keep rendering with the previous map, and the last to
+   * finish publishes the new one.
+   */
+  void update_caustic_map();
+
+  /**
+   * Render the frame in cells handed out to numWorkerProcesses forked copies
+   * of this process, and merge the samples they send back into the path
+   * tracer's buffers. Cells of workers that die are rendered again by new
+   * ones. Forking needs this process to have no render threads yet, so it
+   * only serves one-shot file renders. Returns false if the render failed.
+   */
+  bool render_distributed();
+
+  /**
+   * Render the frame in bands of rows that only hold their own samples, and
+   * stream each band's rows to a tiled EXR file as it finishes. Returns
+   * false if the file could not be written.
+   */
+  bool render_streamed(const std::string& filename);
+
+  /**
+   * Channels of the EXR files this renderer writes: linear RGB, then those
+   * of the selected AOV passes.
+   */
+  std::vector<TiledExrWriter::Channel> exr_channels() const;
+
+  /**
+   * Values of exr_channels() for every pixel of the path tracer's buffers,
+   * rows counted top-down as in the file.
+   */
+  std::shared_ptr<std::vector<float>> exr_pixels() const;
+
+  /**
+   * Body of a worker process: render every cell the coordinator sends over
+   * the socket and send back the accumulated pixels, until it hangs up.
+   */
+  void serve_cells(int socket);
+
+  /**
+   * Samples a tile at (x, y) of a render of the whole frame has left to
+   * spend: ns_aa for each of its pixels, less what they already have.
+   */
+  long long tile_budget(size_t x, size_t y) const;
+
+  /**
+   * Splat the first hits of the pixels rendered so far, seen from
+   * previewCamera, into the frame buffer as seen from the current camera.
+   */
+  void reproject_frame();
+
+  /**
+   * Stop writing checkpoints of the current render, waiting for a write in
+   * progress.
+   */
+  void stop_checkpointing();
+
+  /**
+   * Hash of everything a checkpoint's samples depend on besides the frame
+   * size: the scene file, the camera and the render settings.
+   */
+  uint64_t checkpoint_settings() const;
 
   /**
    * Implementation of a ray tracer worker thread
+   * \param thread index of the worker among workerThreads
    */
-  void worker_thread();
+  void worker_thread(size_t thread);
+
+  /**
+   * Wakes the workers waiting for a tile, after one was queued or retired.
+   */
+  void wake_idle_workers();
 
   enum State {
     INIT,               ///< to be initialized
@@ -209,10 +425,54 @@ public:
 
   // Integration state //
 
-  vector<int> tile_samples; ///< current sample rate for tile
   size_t num_tiles_w;       ///< number of tiles along width of the image
   size_t num_tiles_h;       ///< number of tiles along height of the image
 
+  size_t samplesPerPass;    ///< samples per pixel per progressive pass (0 = single pass)
+  double timeBudget;        ///< render until this many seconds have passed (0 = until the sample budget is spent)
+  std::atomic<bool> finishRequested;  ///< user asked to keep the current image
+  size_t adaptiveMaxRate;   ///< cap on adaptive samples per pixel, as a multiple of ns_aa
+  bool denoiseOutput;       ///< filter the finished render before it is shown and saved
+  bool pathGuiding;         ///< learn and sample from pathGuide while rendering
+  PathGuide pathGuide;      ///< incident radiance learned during the current render
+  double irradianceCacheError;      ///< irradiance cache error threshold (0 = no cache)
+  IrradianceCache irradianceCache;  ///< indirect irradiance cached during the current render
+  size_t causticPhotons;    ///< caustic photons stored per map (0 = no caustics pass)
+  std::atomic<size_t> causticPass;  ///< progressive pass the newest caustic map was traced for
+  std::mutex causticLock;   ///< held while a caustic map rebuild is started
+  std::vector<std::vector<Photon>> causticChunks;  ///< photons of the map being traced, one vector per chunk
+  std::vector<size_t> causticEmitted;  ///< photons emitted for each chunk
+  std::atomic<size_t> causticChunkNext;   ///< next chunk to hand out (past the end = none)
+  std::atomic<size_t> causticChunksDone;  ///< chunks of the map being traced that are done
+  std::atomic<bool> causticBuilding;      ///< a rebuild is handing out chunks
+  double causticRadius;     ///< gather radius of the map being traced
+  bool bidirectional;       ///< render with bdpt instead of unidirectional path tracing
+  BidirectionalPathTracer bdpt;  ///< bidirectional integrator and its light tracing films
+  bool reproducible;        ///< make the image independent of thread count and scheduling
+  string checkpointFile;    ///< file full-frame renders are checkpointed to and resumed from ("" = none)
+  string sceneFile;         ///< path of the scene file, which checkpoints are tied to
+  double checkpointInterval;  ///< seconds between checkpoints
+  Checkpoint checkpoint;    ///< samples of the current render as of its last finished passes
+  std::thread checkpointThread;  ///< writes checkpoints while rendering
+  std::mutex checkpointLock;
+  std::condition_variable checkpointWake;
+  bool checkpointRunning;   ///< checkpointThread should keep writing
+  bool interactive;         ///< preview at coarse resolutions first, and follow camera moves
+  Camera previewCamera;     ///< camera of the current interactive render
+  std::vector<char> reprojected;  ///< frame buffer pixels holding reprojected colors
+  bool reprojectPending;    ///< keep the reprojected frame when the next render starts
+
+  ImageWriter imageWriter;  ///< encodes and writes saved images off the render threads
+  bool streamExr;           ///< render files in bands streamed to a tiled EXR
+  bool streaming;           ///< a streamed render is in progress
+  FrameStats streamTotals;  ///< stats of the bands a streamed render has finished
+  int aovPasses;            ///< AOVPass flags of the passes saved with file renders (0 = none)
+  std::vector<uint32_t> primitiveMaterials;  ///< material index of each primitive, if ids are tracked
+
+  size_t samplesTotal;                    ///< sample budget of the render
+  std::atomic<long long> samplesRemaining; ///< samples left in the budget
+  std::chrono::steady_clock::time_point renderStart;
+
   size_t frame_w, frame_h;
 
   double lensRadius;
@@ -224,21 +484,30 @@ public:
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
 
-  std::vector<int> sampleCountBuffer;   ///< sample count buffer
-
   // Internals //
 
   size_t numWorkerThreads;
+  size_t numWorkerProcesses;  ///< processes file renders are spread over (0 = render in this one)
+  std::vector<long long> cellBudgets;  ///< sample budgets of a worker's cell's tiles (empty = not a worker)
+  double cellElapsed;       ///< seconds the coordinator's render had taken when it sent the cell
   size_t imageTileSize;
 
   bool continueRaytracing;                  ///< rendering should continue
-  std::vector<std::thread*> workerThreads;  ///< pool of worker threads
+  std::shared_ptr<ThreadPool> workerPool;   ///< worker threads, kept between renders
   std::atomic<int> workerDoneCount;         ///< worker threads management
-  WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+  std::vector<WorkItem> tiles;              ///< tiles of the render, then spare slots for splits
+  std::atomic<size_t> tileCount;            ///< slots of tiles in use
+  WorkQueue workQueue;                      ///< indices of the tiles waiting for a pass
+  std::atomic<int> tilesActive;             ///< tiles queued or being rendered
+  std::atomic<int> idleWorkers;             ///< workers that found the queue empty
+  std::atomic<int> tilesUnderMin;           ///< tiles of a time-budgeted render short of their minimum samples
+  std::atomic<int> progressShown;           ///< last progress percentage printed
+  std::mutex workLock;                      ///< guards idle workers' sleep
+  std::condition_variable workReady;        ///< signaled when a tile is queued or retires
+  static const size_t maxTileSplits = 4;    ///< tile slots per initial tile
+  static const size_t minSplitRows = 4;     ///< rows each half of a split tile keeps at least
   std::condition_variable cv_done;
   std::mutex m_done;
-  size_t tilesDone;
-  size_t tilesTotal;
 
   // Visualizer Controls //
 
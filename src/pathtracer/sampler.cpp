@@ -1,13 +1,248 @@
 #include "sampler.h"
 
+#include <vector>
+
 namespace CGL {
 
+// Pixel Sample Sequences //
+
+namespace {
+
+struct PixelSample {
+  SampleSequence sequence;
+  uint32_t x, y;        ///< pixel coordinates
+  uint32_t seed;        ///< scrambles the sequence for the pixel
+  uint32_t index;       ///< index of the sample in the pixel's sequence
+  uint32_t dimension;   ///< next dimension to draw
+};
+
+thread_local PixelSample current = { SEQUENCE_RANDOM, 0, 0, 0, 0, 0 };
+
+// Halton dimensions past the last prime take random numbers; by then the
+// sequence is no better than random anyway.
+const int numPrimes = 64;
+const uint32_t primes[numPrimes] = {
+    2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+   59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+  137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+  227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+inline uint32_t hash(uint32_t x, uint32_t seed) {
+  x ^= seed * 0x9e3779b9u;
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+/**
+ * Owen scrambling of a base 2 fraction in fixed point: every bit is flipped
+ * or not depending on the bits above it (Burley 2020, after Laine and
+ * Karras 2011).
+ */
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  x = reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverse_bits(x);
+}
+
+/**
+ * The first two Sobol dimensions in fixed point: the van der Corput
+ * sequence, and the dimension its (0, 2)-sequence partner.
+ */
+inline uint32_t sobol(uint32_t index, int dimension) {
+  if (dimension == 0) return reverse_bits(index);
+  uint32_t x = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) x ^= v;
+  }
+  return x;
+}
+
+inline double to_unit(double x) {
+  return clamp(x, 0.0000001, 0.99999999);
+}
+
+double sobol_sample(uint32_t seed, uint32_t index, uint32_t dimension) {
+  // Higher dimensions reuse the 2D sequence, with the index shuffled by a
+  // scrambling of its own for every pair so that pairs stay uncorrelated.
+  uint32_t pair = dimension / 2;
+  uint32_t shuffled = owen_scramble(index, hash(pair, seed));
+  uint32_t x = owen_scramble(sobol(shuffled, dimension & 1), hash(dimension, seed ^ 0x5bd1e995u));
+  return to_unit(x / 4294967296.0);
+}
+
+double halton_sample(uint32_t seed, uint32_t index, uint32_t dimension) {
+  if (dimension >= (uint32_t) numPrimes) return random_uniform();
+
+  // Radical inverse, with every digit shifted by an amount that depends on
+  // the digits below it in the index: Owen scrambling restricted to cyclic
+  // digit permutations. Digits go on past the index's own so the
+  // scrambling fills the whole interval.
+  uint32_t base = primes[dimension];
+  double inv_base = 1.0 / base, scale = inv_base, x = 0;
+  uint32_t prefix = hash(dimension, seed);
+  while (scale > 1e-10) {
+    uint32_t digit = index % base;
+    index /= base;
+    x += ((digit + hash(prefix, seed)) % base) * scale;
+    prefix = hash(prefix, digit + 1);
+    scale *= inv_base;
+  }
+  return to_unit(x);
+}
+
+const int blueNoiseSize = 64;
+
+/**
+ * A tileable blue noise dither mask, made by void and cluster (Ulichney
+ * 1993): points are ranked by adding them one at a time where the Gaussian
+ * energy of the points so far is lowest, after settling an initial random
+ * tenth of them. Values are the ranks spread over [0, 1).
+ */
+std::vector<float> make_blue_noise_mask() {
+  const int n = blueNoiseSize, count = n * n;
+  const double sigma = 1.5;
+
+  std::vector<double> kernel(count);
+  for (int dy = 0; dy < n; dy++) {
+    for (int dx = 0; dx < n; dx++) {
+      int wx = std::min(dx, n - dx), wy = std::min(dy, n - dy);
+      kernel[dx + dy * n] = exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+    }
+  }
+
+  std::vector<bool> on(count, false);
+  std::vector<double> energy(count, 0);
+  auto toggle = [&](int p, double sign) {
+    on[p] = sign > 0;
+    int px = p % n, py = p / n;
+    for (int y = 0; y < n; y++) {
+      for (int x = 0; x < n; x++) {
+        energy[x + y * n] += sign * kernel[(x - px + n) % n + ((y - py + n) % n) * n];
+      }
+    }
+  };
+  auto extreme = [&](bool of_on, bool highest) {
+    int best = -1;
+    for (int p = 0; p < count; p++) {
+      if (on[p] != of_on) continue;
+      if (best < 0 || (highest ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+    }
+    return best;
+  };
+
+  // The same mask every run, whatever the render's seed.
+  PCG32 rng(1, 1);
+  int initial = 0;
+  while (initial < count / 10) {
+    int p = rng.next() % count;
+    if (!on[p]) {
+      toggle(p, 1);
+      initial++;
+    }
+  }
+  while (true) {
+    int cluster = extreme(true, true);
+    toggle(cluster, -1);
+    int gap = extreme(false, false);
+    toggle(gap, 1);
+    if (gap == cluster) break;
+  }
+
+  std::vector<int> rank(count);
+  std::vector<bool> initial_on = on;
+  std::vector<double> initial_energy = energy;
+  for (int r = initial - 1; r >= 0; r--) {
+    int cluster = extreme(true, true);
+    toggle(cluster, -1);
+    rank[cluster] = r;
+  }
+  on = initial_on;
+  energy = initial_energy;
+  for (int r = initial; r < count; r++) {
+    int gap = extreme(false, false);
+    toggle(gap, 1);
+    rank[gap] = r;
+  }
+
+  std::vector<float> mask(count);
+  for (int p = 0; p < count; p++) mask[p] = (rank[p] + 0.5f) / count;
+  return mask;
+}
+
+double blue_noise_sample(uint32_t seed, uint32_t index, uint32_t dimension,
+                         uint32_t x, uint32_t y) {
+  static const std::vector<float> mask = make_blue_noise_mask();
+
+  // Every dimension reads the mask at an offset of its own, so the shifts
+  // of different dimensions are unrelated while each is blue over the image.
+  uint32_t offset = hash(dimension, 0x68e31da4u);
+  x = (x + offset) % blueNoiseSize;
+  y = (y + (offset >> 16)) % blueNoiseSize;
+  double u = sobol_sample(seed, index, dimension) + mask[x + y * blueNoiseSize];
+  return to_unit(u < 1 ? u : u - 1);
+}
+
+}  // namespace
+
+void start_pixel_sample(SampleSequence sequence, uint32_t x, uint32_t y,
+                        uint32_t index, uint32_t seed) {
+  current.sequence = sequence;
+  current.x = x;
+  current.y = y;
+  current.seed = sequence == SEQUENCE_BLUE_NOISE ? hash(seed, 0x2545f491u)
+                                                 : hash(x | y << 16, seed + 0x2545f491u);
+  current.index = index;
+  current.dimension = 0;
+}
+
+void end_pixel_sample() {
+  current.sequence = SEQUENCE_RANDOM;
+}
+
+double sample_1d() {
+  switch (current.sequence) {
+    case SEQUENCE_SOBOL:
+      return sobol_sample(current.seed, current.index, current.dimension++);
+    case SEQUENCE_HALTON:
+      return halton_sample(current.seed, current.index, current.dimension++);
+    case SEQUENCE_BLUE_NOISE:
+      return blue_noise_sample(current.seed, current.index, current.dimension++,
+                               current.x, current.y);
+    default:
+      return random_uniform();
+  }
+}
+
+Vector2D sample_2d() {
+  current.dimension += current.dimension & 1;
+  double x = sample_1d();
+  return Vector2D(x, sample_1d());
+}
+
 /**
  * A Sampler2D implementation with uniform distribution on unit square
  */
 Vector2D UniformGridSampler2D::get_sample() const {
 
-  return Vector2D(random_uniform(), random_uniform());
+  return sample_2d();
 
 }
 
@@ -15,10 +250,11 @@ Vector2D UniformGridSampler2D::get_sample() const {
 // Uniform Sphere Sampler3D Implementation //
 
 Vector3D UniformSphereSampler3D::get_sample() const {
-  double z = random_uniform() * 2 - 1;
+  Vector2D u = sample_2d();
+  double z = u.x * 2 - 1;
   double sinTheta = sqrt(std::max(0.0, 1.0f - z * z));
 
-  double phi = 2.0f * PI * random_uniform();
+  double phi = 2.0f * PI * u.y;
 
   return Vector3D(cos(phi) * sinTheta, sin(phi) * sinTheta, z);
 }
@@ -29,8 +265,9 @@ Vector3D UniformSphereSampler3D::get_sample() const {
  */
 Vector3D UniformHemisphereSampler3D::get_sample() const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  Vector2D u = sample_2d();
+  double Xi1 = u.x;
+  double Xi2 = u.y;
 
   double theta = acos(Xi1);
   double phi = 2.0 * PI * Xi2;
@@ -58,8 +295,9 @@ Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
  */
 Vector3D CosineWeightedHemisphereSampler3D::get_sample(double *pdf) const {
 
-  double Xi1 = random_uniform();
-  double Xi2 = random_uniform();
+  Vector2D u = sample_2d();
+  double Xi1 = u.x;
+  double Xi2 = u.y;
 
   double r = sqrt(Xi1);
   double theta = 2. * PI * Xi2;
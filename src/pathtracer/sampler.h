@@ -1,6 +1,8 @@
 #ifndef CGL_SAMPLER_H
 #define CGL_SAMPLER_H
 
+#include <cstdint>
+
 #include "CGL/vector2D.h"
 #include "CGL/vector3D.h"
 #include "CGL/misc.h"
@@ -8,6 +10,47 @@
 
 namespace CGL {
 
+/**
+ * Sequences the samples of a pixel can draw their random numbers from.
+ */
+enum SampleSequence {
+  SEQUENCE_RANDOM,   ///< independent random numbers
+  SEQUENCE_SOBOL,    ///< Owen-scrambled Sobol points, padded in pairs of dimensions
+  SEQUENCE_HALTON,   ///< Owen-scrambled Halton points
+  SEQUENCE_BLUE_NOISE  ///< one Sobol sequence for the image, toroidally shifted per pixel by blue noise
+};
+
+/**
+ * Make the calling thread draw the dimensions of sample `index` of a pixel
+ * from the given sequence, one dimension per random number, until
+ * end_pixel_sample(). Every pixel gets its own scrambling of the sequence,
+ * so consecutive indices of a pixel are well stratified against each other
+ * but unrelated to those of other pixels and other seeds. Blue noise is the
+ * exception: neighboring pixels get deliberately different shifts of one
+ * sequence, so that at a few samples per pixel their errors differ the
+ * most from pixel to pixel and average out at a glance.
+ * \param x, y coordinates of the pixel in the image
+ */
+void start_pixel_sample(SampleSequence sequence, uint32_t x, uint32_t y,
+                        uint32_t index, uint32_t seed = 0);
+
+/**
+ * Go back to independent random numbers on the calling thread.
+ */
+void end_pixel_sample();
+
+/**
+ * Next dimension of the calling thread's pixel sample, or an independent
+ * random number outside of one. In [0, 1), like random_uniform().
+ */
+double sample_1d();
+
+/**
+ * Next two dimensions of the calling thread's pixel sample, starting on an
+ * even dimension so the pair is stratified in two dimensions.
+ */
+Vector2D sample_2d();
+
 /**
  * Interface for generating 2D vector samples
  */
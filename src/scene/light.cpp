@@ -3,6 +3,7 @@
 #include <iostream>
 
 #include "pathtracer/sampler.h"
+#include "pathtracer/bsdf.h"  // make_coord_space
 
 namespace CGL { namespace SceneObjects {
 
@@ -56,6 +57,21 @@ Vector3D PointLight::sample_L(const Vector3D p, Vector3D* wi,
   return radiance;
 }
 
+// Light from a point light does not fall off with distance (see sample_L):
+// photons leave with the power of an intensity of radiance, and
+// photon_arrival undoes their spreading out where they first land.
+Vector3D PointLight::sample_photon(Vector3D* origin, Vector3D* dir) const {
+  UniformSphereSampler3D sampler;
+  *origin = position;
+  *dir = sampler.get_sample();
+  return 4 * PI * radiance;
+}
+
+void PointLight::photon_pdf(const Vector3D& dir, double* pdf_pos, double* pdf_dir) const {
+  *pdf_pos = 1;
+  *pdf_dir = 1 / (4 * PI);
+}
+
 
 // Spot Light //
 
@@ -92,6 +108,24 @@ Vector3D AreaLight::sample_L(const Vector3D p, Vector3D* wi,
   return cosTheta < 0 ? radiance : Vector3D();
 };
 
+Vector3D AreaLight::sample_photon(Vector3D* origin, Vector3D* dir) const {
+  // Cosine-weighted directions off a uniform point cancel the light's
+  // cosine falloff, leaving radiance times area times pi for every photon.
+  CosineWeightedHemisphereSampler3D hemisphere;
+  Matrix3x3 o2w;
+  make_coord_space(o2w, direction);
+
+  Vector2D sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
+  *origin = position + sample.x * dim_x + sample.y * dim_y;
+  *dir = o2w * hemisphere.get_sample();
+  return radiance * area * PI;
+}
+
+void AreaLight::photon_pdf(const Vector3D& dir, double* pdf_pos, double* pdf_dir) const {
+  *pdf_pos = 1 / area;
+  *pdf_dir = std::max(0.0, dot(dir, direction.unit())) / PI;
+}
+
 
 // Sphere Light //
 
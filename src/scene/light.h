@@ -49,6 +49,9 @@ class PointLight : public SceneLight {
   PointLight(const Vector3D rad, const Vector3D pos);
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
+  Vector3D sample_photon(Vector3D* origin, Vector3D* dir) const;
+  void photon_pdf(const Vector3D& dir, double* pdf_pos, double* pdf_dir) const;
+  double photon_arrival(double dist) const { return dist * dist; }
   bool is_delta_light() const { return true; }
 
   Vector3D radiance;
@@ -82,6 +85,9 @@ class AreaLight : public SceneLight {
             const Vector3D dim_x, const Vector3D dim_y);
   Vector3D sample_L(const Vector3D p, Vector3D* wi, double* distToLight,
                     double* pdf) const;
+  Vector3D sample_photon(Vector3D* origin, Vector3D* dir) const;
+  void photon_pdf(const Vector3D& dir, double* pdf_pos, double* pdf_dir) const;
+  Vector3D photon_normal() const { return direction.unit(); }
   bool is_delta_light() const { return false; }
 
   Vector3D radiance;
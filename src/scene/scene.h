@@ -38,6 +38,40 @@ class SceneLight {
                             double* distToLight, double* pdf) const = 0;
   virtual bool is_delta_light() const = 0;
 
+  /**
+   * Sample a photon leaving the light.
+   * \param origin address to store the photon's starting point
+   * \param dir address to store the photon's direction
+   * \return the photon's power, such that the mean over many photons is the
+   *         light's total power; lights that cannot emit photons return zero
+   */
+  virtual Vector3D sample_photon(Vector3D* origin, Vector3D* dir) const {
+    return Vector3D();
+  }
+
+  /**
+   * Densities with which sample_photon produces a photon leaving the light
+   * in the given direction: pdf_pos per unit area of the light (1 for a
+   * light at a point) and pdf_dir per unit solid angle. Both are zero for
+   * lights that cannot emit photons.
+   */
+  virtual void photon_pdf(const Vector3D& dir, double* pdf_pos, double* pdf_dir) const {
+    *pdf_pos = *pdf_dir = 0;
+  }
+
+  /**
+   * Normal of the light's emitting surface; zero for a light at a point.
+   */
+  virtual Vector3D photon_normal() const { return Vector3D(); }
+
+  /**
+   * Factor on a photon's power where it first lands, at the given distance
+   * from the light. Photons spread out with the square of the distance, so
+   * lights whose sample_L does not fall off with distance return its square
+   * to make the light arriving there the same as sample_L reports.
+   */
+  virtual double photon_arrival(double dist) const { return 1; }
+
 };
 
 
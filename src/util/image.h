@@ -3,10 +3,14 @@
 
 #include "CGL/color.h"
 #include "CGL/vector3D.h"
+#include "util/thread_pool.h"
 
+#include <algorithm>
 #include <vector>
 #include <string.h>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 
 namespace CGL {
 
@@ -81,6 +85,181 @@ struct ImageBuffer {
   std::vector<uint32_t> data;  ///< pixel buffer
 };
 
+/**
+ * Linear RGB value in single precision, half the size of a Vector3D.
+ */
+struct FloatRGB {
+  FloatRGB() : r(0), g(0), b(0) {}
+  FloatRGB(const Vector3D& v) : r(v.x), g(v.y), b(v.z) {}
+
+  operator Vector3D() const { return Vector3D(r, g, b); }
+
+  float r, g, b;
+};
+
+/**
+ * Round a float to the nearest half float, ties to even.
+ */
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t mantissa = x & 0x7fffff;
+  int exponent = (int) ((x >> 23) & 0xff);
+
+  if (exponent == 255) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  int e = exponent - 127 + 15;
+  if (e >= 31) return sign | 0x7c00;
+
+  uint32_t half, rest, halfway;
+  if (e <= 0) {
+    // Subnormal: the implicit bit becomes explicit and shifts down.
+    if (e < -10) return sign;
+    mantissa |= 0x800000;
+    int shift = 14 - e;
+    half = mantissa >> shift;
+    rest = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  } else {
+    half = (e << 10) | (mantissa >> 13);
+    rest = mantissa & 0x1fff;
+    halfway = 0x1000;
+  }
+  // A carry out of the mantissa correctly bumps the exponent.
+  if (rest > halfway || (rest == halfway && (half & 1))) half++;
+  return sign | half;
+}
+
+/**
+ * Widen a half float to a float, which holds every half exactly.
+ */
+inline float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 31) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {
+    // Subnormal: shift the leading bit up to the implicit position.
+    int e = -1;
+    do {
+      e++;
+      mantissa <<= 1;
+    } while (!(mantissa & 0x400));
+    x = sign | ((uint32_t) (127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+/**
+ * Linear RGB value in half precision. Plenty for the first-hit features
+ * the denoiser and the AOV passes read, at a quarter of a Vector3D.
+ */
+struct HalfRGB {
+  HalfRGB() : r(0), g(0), b(0) {}
+  HalfRGB(const Vector3D& v)
+      : r(float_to_half(v.x)), g(float_to_half(v.y)), b(float_to_half(v.z)) {}
+
+  operator Vector3D() const {
+    return Vector3D(half_to_float(r), half_to_float(g), half_to_float(b));
+  }
+
+  uint16_t r, g, b;
+};
+
+/**
+ * Gamma and exposure encoding of linear values to 8 bit channels.
+ *
+ * A channel encodes to the largest k with (v * exposure)^(1/gamma) >= k/255,
+ * the same byte ImageBuffer::update_pixel makes of the gamma-corrected
+ * color. Rather than taking a pow per channel, the encoder precomputes the
+ * linear value where each of the 255 steps begins. The exponent and top
+ * mantissa bits of the value as a float index a table of the step at the
+ * start of each such bucket. Buckets are narrower than the steps, so two
+ * comparisons finish the lookup without branching.
+ */
+struct ColorEncoder {
+
+  /**
+   * \param gamma gamma value
+   * \param level exposure level adjustment
+   * \param scale factor applied to the linear values first
+   */
+  ColorEncoder(double gamma = 2.2, double level = 1.0, double scale = 1.0) {
+    double exposure = sqrt(pow(2, level)) * scale;
+    threshold[0] = 0;
+    for (size_t k = 1; k < 256; k++) {
+      threshold[k] = pow(k / 255.0, gamma) / exposure;
+    }
+    threshold[256] = INFINITY;
+    darkest = threshold[1] / 2;
+
+    bucketBase = bucket(darkest);
+    bucketStart.resize(bucket(threshold[255]) - bucketBase + 1);
+    uint32_t k = 0;
+    for (size_t b = 0; b < bucketStart.size(); b++) {
+      uint32_t bits = (uint32_t) (bucketBase + b) << bucketShift;
+      float lower;
+      memcpy(&lower, &bits, sizeof(lower));
+      while (k < 255 && lower >= threshold[k + 1]) k++;
+      bucketStart[b] = (uint8_t) k;
+    }
+  }
+
+  /**
+   * Encode one linear channel value.
+   */
+  uint32_t encode(double v) const {
+    // Clamp into the table, sending NaN to black.
+    v = std::min(std::max(darkest, v), threshold[255]);
+    uint32_t k = bucketStart[bucket(v) - bucketBase];
+    // The value may have rounded up into the next bucket as a float, and
+    // a step may begin inside its bucket.
+    k -= v < threshold[k];
+    k += v >= threshold[k + 1];
+    return k;
+  }
+
+  /**
+   * Encode a linear color as an opaque ImageBuffer pixel.
+   */
+  uint32_t encode(const Vector3D& s) const {
+    return 0xFF000000 | (encode(s.b) << 16) | (encode(s.g) << 8) | encode(s.r);
+  }
+
+  uint32_t encode(const FloatRGB& s) const {
+    return 0xFF000000 | (encode(s.b) << 16) | (encode(s.g) << 8) | encode(s.r);
+  }
+
+ private:
+
+  static const int bucketShift = 15;  ///< keeps the exponent and 8 mantissa bits
+
+  /**
+   * Bucket of a positive value: its float bits, which order like the
+   * values, with the low mantissa bits dropped. A bucket spans at most
+   * 0.4% of its lower bound, and a step at least 0.86%.
+   */
+  static uint32_t bucket(double v) {
+    float f = (float) v;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits >> bucketShift;
+  }
+
+  double threshold[257];             ///< linear value where each encoded step begins, then infinity
+  double darkest;                    ///< a value below the first step, where the table starts
+  uint32_t bucketBase;               ///< bucket of darkest
+  std::vector<uint8_t> bucketStart;  ///< step at the lower bound of each bucket from bucketBase
+};
+
 /**
  * High Dynamic Range image buffer which stores linear space Vector3D
  * values with 32 bit floating points.
@@ -147,54 +326,80 @@ struct HDRImageBuffer {
    * \param level exposure level adjustment
    * \key   key value to map average tone to (higher means brighter)
    * \why   white point (higher means larger dynamic range)
+   * \param pool threads to spread the work over (NULL for the calling thread only)
    */
   void tonemap(ImageBuffer& target,
-    float gamma, float level, float key, float wht) {
+    float gamma, float level, float key, float wht, ThreadPool* pool = NULL) {
 
-    // compute global log average luminance!
-    float avg = 0;
-    for (size_t i = 0; i < w * h; ++i) {
-      // the small delta value below is used to avoids singularity
-      avg += log(0.0000001f + data[i].illum());
-    }
+    // compute global log average luminance, each band of rows summed apart!
+    std::vector<double> sums(bands(h, pool), 0);
+    for_rows(0, h, pool, [&](size_t row0, size_t row1, size_t t) {
+      double sum = 0;
+      for (size_t i = row0 * w; i < row1 * w; ++i) {
+        // the small delta value below is used to avoids singularity
+        sum += log(0.0000001f + data[i].illum());
+      }
+      sums[t] = sum;
+    });
+    double avg = 0;
+    for (double sum : sums) avg += sum;
     avg = exp(avg / (w * h));
 
-
-    // apply on pixels
-    float one_over_gamma = 1.0f / gamma;
-    float exposure = sqrt(pow(2,level));
-    for (size_t y = 0; y < h; ++y) {
-      for (size_t x = 0; x < w; ++x) {
-        Vector3D s = data[x + y * w];
-        float l = s.illum();
-        s *= key / avg;
-        s *= ((l + 1) / (wht * wht)) / (l + 1);
-        float r = pow(s.r * exposure, one_over_gamma);
-        float g = pow(s.g * exposure, one_over_gamma);
-        float b = pow(s.b * exposure, one_over_gamma);
-        target.update_pixel(Color(r, g, b), x, y);
-      }
-    }
+    // Mapping the average to the key and dividing by the squared white
+    // point scales every pixel alike, so it folds into the encoder.
+    ColorEncoder encoder(gamma, level, key / (avg * wht * wht));
+    toColor(target, encoder, 0, 0, w, h, pool);
   }
 
   /**
    * Convert the given tile of the buffer to color.
    */
-  void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1) {
-
-    float gamma = 2.2f;
-    float level = 1.0f;
-    float one_over_gamma = 1.0f / gamma;
-    float exposure = sqrt(pow(2,level));
-    for (size_t y = y0; y < y1; ++y) {
-      for (size_t x = x0; x < x1; ++x) {
-        const Vector3D& s = data[x + y * w];
-        float r = std::max(0.0, std::min(pow(s.r * exposure, one_over_gamma), 1.0));
-        float g = std::max(0.0, std::min(pow(s.g * exposure, one_over_gamma), 1.0));
-        float b = std::max(0.0, std::min(pow(s.b * exposure, one_over_gamma), 1.0));
-        target.update_pixel(Color(r, g, b), x, y);
+  void toColor(ImageBuffer& target, size_t x0, size_t y0, size_t x1, size_t y1,
+               double gamma = 2.2, double level = 1.0) {
+    toColor(target, ColorEncoder(gamma, level), x0, y0, x1, y1);
+  }
+
+  /**
+   * Convert the given tile of the buffer to color with the encoder, spreading
+   * its rows over the pool.
+   */
+  void toColor(ImageBuffer& target, const ColorEncoder& encoder,
+               size_t x0, size_t y0, size_t x1, size_t y1, ThreadPool* pool = NULL) {
+    for_rows(y0, y1, pool, [&](size_t row0, size_t row1, size_t t) {
+      for (size_t y = row0; y < row1; ++y) {
+        const Vector3D* in = &data[y * w];
+        uint32_t* out = &target.data[y * target.w];
+        for (size_t x = x0; x < x1; ++x) {
+          out[x] = encoder.encode(in[x]);
+        }
       }
+    });
+  }
+
+  /**
+   * Number of bands for_rows splits this many rows into.
+   */
+  static size_t bands(size_t rows, ThreadPool* pool) {
+    size_t threads = pool ? pool->size() : 1;
+    return std::max(std::min(threads, rows / 16), (size_t) 1);
+  }
+
+  /**
+   * Run f(row0, row1, t) over bands of [y0, y1), band t on whichever thread
+   * of the pool picks it up. Small regions stay on the calling thread,
+   * where handing out bands would cost more than it saves.
+   */
+  template <typename F>
+  static void for_rows(size_t y0, size_t y1, ThreadPool* pool, F f) {
+    size_t rows = y1 - y0;
+    size_t n = bands(rows, pool);
+    if (n == 1) {
+      f(y0, y1, 0);
+      return;
     }
+    pool->for_each(n, [&](size_t t) {
+      f(y0 + rows * t / n, y0 + rows * (t + 1) / n, t);
+    });
   }
 
   /**
@@ -216,6 +421,107 @@ struct HDRImageBuffer {
 
 }; // class HDRImageBuffer
 
+/**
+ * Image buffer of linear RGB values in single precision, which the path
+ * tracer accumulates its samples into. Each pass over a pixel averages its
+ * samples in double precision and only blends the average into the
+ * buffer, so the pixels keep full float precision however many passes they
+ * take.
+ */
+struct FloatImageBuffer {
+
+  FloatImageBuffer() : w(0), h(0) {}
+
+  /**
+   * Resize the image buffer and clear it to black.
+   */
+  void resize(size_t w, size_t h) {
+    this->w = w;
+    this->h = h;
+    clear();
+  }
+
+  /**
+   * Blend a new value into a pixel: buffer[i] = s * r + buffer[i] * (1-r).
+   */
+  void update_pixel(const Vector3D& s, size_t x, size_t y, float r) {
+    FloatRGB& p = data[x + y * w];
+    p.r += (s.x - p.r) * r;
+    p.g += (s.y - p.g) * r;
+    p.b += (s.z - p.b) * r;
+  }
+
+  /**
+   * Convert the given tile of the buffer to color with the encoder, spreading
+   * its rows over the pool.
+   */
+  void toColor(ImageBuffer& target, const ColorEncoder& encoder,
+               size_t x0, size_t y0, size_t x1, size_t y1, ThreadPool* pool = NULL) const {
+    HDRImageBuffer::for_rows(y0, y1, pool, [&](size_t row0, size_t row1, size_t t) {
+      for (size_t y = row0; y < row1; ++y) {
+        const FloatRGB* in = &data[y * w];
+        uint32_t* out = &target.data[y * target.w];
+        for (size_t x = x0; x < x1; ++x) {
+          out[x] = encoder.encode(in[x]);
+        }
+      }
+    });
+  }
+
+  /**
+   * Clear image buffer.
+   */
+  void clear() {
+    data.clear();
+    data.resize(w * h);
+  }
+
+  size_t w; ///< width
+  size_t h; ///< height
+  std::vector<FloatRGB> data; ///< pixel buffer
+
+}; // class FloatImageBuffer
+
+/**
+ * Image buffer of linear RGB values in half precision, for the first-hit
+ * features the path tracer averages alongside its samples.
+ */
+struct HalfImageBuffer {
+
+  HalfImageBuffer() : w(0), h(0) {}
+
+  /**
+   * Resize the image buffer and clear it to black.
+   */
+  void resize(size_t w, size_t h) {
+    this->w = w;
+    this->h = h;
+    clear();
+  }
+
+  /**
+   * Blend a new value into a pixel: buffer[i] = s * r + buffer[i] * (1-r).
+   */
+  void update_pixel(const Vector3D& s, size_t x, size_t y, float r) {
+    HalfRGB& p = data[x + y * w];
+    Vector3D v = p;
+    p = v + (s - v) * r;
+  }
+
+  /**
+   * Clear image buffer.
+   */
+  void clear() {
+    data.clear();
+    data.resize(w * h);
+  }
+
+  size_t w; ///< width
+  size_t h; ///< height
+  std::vector<HalfRGB> data; ///< pixel buffer
+
+}; // class HalfImageBuffer
+
 
 } // namespace CGL
 
@@ -0,0 +1,95 @@
+#ifndef __IMAGE_WRITER_H__
+#define __IMAGE_WRITER_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Background threads that encode and write finished images, so the render
+ * that produced one can return, and the next start, while it compresses.
+ *
+ * Jobs own copies of what they write. At most `capacity` jobs wait to
+ * start; pushing more blocks until one does, which bounds the frames held
+ * in memory when renders outpace the disk. The threads start with the first
+ * job, so renderers that never write an image never start them.
+ */
+class ImageWriter {
+ private:
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable changed;   ///< a job was queued, started or finished, or the writer shuts down
+  std::deque<std::function<void()>> jobs;
+  size_t numThreads;
+  size_t capacity;
+  size_t busy;                       ///< jobs being run
+  bool quit;
+
+  void loop() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lk(lock);
+        changed.wait(lk, [&] { return quit || !jobs.empty(); });
+        if (jobs.empty()) return;
+        job = jobs.front();
+        jobs.pop_front();
+        busy++;
+      }
+      changed.notify_all();
+      job();
+      {
+        std::lock_guard<std::mutex> lk(lock);
+        busy--;
+      }
+      changed.notify_all();
+    }
+  }
+
+ public:
+
+  ImageWriter(size_t num_threads = 2, size_t capacity = 4)
+      : numThreads(num_threads), capacity(capacity), busy(0), quit(false) {}
+
+  /**
+   * Finish the queued jobs, then stop the threads.
+   */
+  ~ImageWriter() {
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      quit = true;
+    }
+    changed.notify_all();
+    for (std::thread& thread : threads) thread.join();
+  }
+
+  /**
+   * Queue a job, waiting for room in the queue first.
+   */
+  void push(std::function<void()> job) {
+    {
+      std::unique_lock<std::mutex> lk(lock);
+      if (threads.empty()) {
+        for (size_t t = 0; t < numThreads; t++) {
+          threads.push_back(std::thread(&ImageWriter::loop, this));
+        }
+      }
+      changed.wait(lk, [&] { return jobs.size() < capacity; });
+      jobs.push_back(job);
+    }
+    changed.notify_all();
+  }
+
+  /**
+   * Block until every queued job has finished.
+   */
+  void wait() {
+    std::unique_lock<std::mutex> lk(lock);
+    changed.wait(lk, [&] { return jobs.empty() && busy == 0; });
+  }
+};
+
+#endif  // __IMAGE_WRITER_H__
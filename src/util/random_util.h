@@ -1,24 +1,78 @@
 #ifndef CGL_RANDOMUTIL_H
 #define CGL_RANDOMUTIL_H
 
-#include <random>
-
-// #define XORSHIFT_RAND
+#include <atomic>
+#include <cstdint>
 
 namespace CGL {
 
-static std::mersenne_twister_engine<std::uint_fast32_t, 32, 624, 397, 31, 0x9908b0df,
-                             11, 0xffffffff, 7, 0x9d2c5680, 15, 0xefc60000, 18,
-                             1812433253> minstd_engine;
+/**
+ * PCG32 (O'Neill 2014): a 64-bit LCG with a permuted 32-bit output. Small
+ * enough to give every thread its own, and each stream is an independent
+ * sequence.
+ */
+class PCG32 {
+ public:
+
+  PCG32(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+    set_seed(seed, stream);
+  }
+
+  void set_seed(uint64_t seed, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+  }
 
-static double rmax = 1.0 / (minstd_engine.max() - minstd_engine.min());
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t) (old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
 
+ private:
+  uint64_t state;
+  uint64_t inc;
+};
+
+/**
+ * Scramble a 64-bit value (the splitmix64 finalizer), for turning counters
+ * into well-spread seeds.
+ */
+inline uint64_t mix_bits(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * The calling thread's generator. Threads that never call seed_random()
+ * still get streams of their own, numbered in the order they first draw.
+ */
+inline PCG32& thread_random() {
+  static std::atomic<uint64_t> threads(0);
+  thread_local PCG32 rng(mix_bits(0), threads++);
+  return rng;
+}
+
+/**
+ * Restart the calling thread's generator at a stream determined by the
+ * given counters, e.g. a pixel and the index of a sample within it.
+ */
+inline void seed_random(uint64_t seed, uint64_t stream) {
+  thread_random().set_seed(mix_bits(seed), mix_bits(stream));
+}
 
 /**
  * Returns a number distributed uniformly over [0, 1].
  */
 inline double random_uniform() {
-  return clamp(double(minstd_engine() - minstd_engine.min()) * rmax, 0.0000001, 0.99999999);
+  return clamp(thread_random().next() * (1.0 / 4294967296.0), 0.0000001, 0.99999999);
 }
 
 /**
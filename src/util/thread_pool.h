@@ -0,0 +1,155 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Threads that stay alive between jobs. A job is a function every thread of
+ * the pool runs once, given its index in the pool; threads sleep while no
+ * job is running. Short tasks split into parts (see for_each) run on the
+ * threads that have no job to run, alongside the caller.
+ */
+class ThreadPool {
+ private:
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable wake;      ///< a job was started, or the pool shuts down
+  std::condition_variable finished; ///< the last thread of a job returned
+  std::function<void(size_t)> job;
+  size_t generation;                 ///< number of jobs started
+  size_t running;                    ///< threads still running the current job
+  bool quit;
+
+  std::mutex taskLock;               ///< one for_each at a time
+  std::condition_variable taskFinished; ///< the last part of the task returned
+  const std::function<void(size_t)>* task;
+  size_t taskParts;                  ///< parts of the current task
+  size_t taskNext;                   ///< next part to hand out
+  size_t taskDone;                   ///< parts that have returned
+
+  /**
+   * Run parts of the current task until none are left. Called with the
+   * lock held, which is released while a part runs.
+   */
+  void run_parts(std::unique_lock<std::mutex>& lk) {
+    while (taskNext < taskParts) {
+      size_t part = taskNext++;
+      const std::function<void(size_t)>& f = *task;
+      lk.unlock();
+      f(part);
+      lk.lock();
+      if (++taskDone == taskParts) taskFinished.notify_all();
+    }
+  }
+
+  /**
+   * Body of a pool thread. seen is the number of jobs started before the
+   * thread was, none of which it is to run.
+   */
+  void loop(size_t thread, size_t seen) {
+    while (true) {
+      std::function<void(size_t)> current;
+      {
+        std::unique_lock<std::mutex> lk(lock);
+        wake.wait(lk, [&] { return quit || generation != seen || taskNext < taskParts; });
+        if (quit) return;
+        if (taskNext < taskParts) {
+          run_parts(lk);
+          continue;
+        }
+        seen = generation;
+        current = job;
+      }
+      current(thread);
+      std::lock_guard<std::mutex> lk(lock);
+      if (--running == 0) finished.notify_all();
+    }
+  }
+
+  void shutdown() {
+    wait();
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) thread.join();
+    threads.clear();
+    quit = false;
+  }
+
+ public:
+
+  ThreadPool()
+      : generation(0), running(0), quit(false),
+        task(NULL), taskParts(0), taskNext(0), taskDone(0) {}
+
+  ~ThreadPool() {
+    shutdown();
+  }
+
+  size_t size() const {
+    return threads.size();
+  }
+
+  /**
+   * Make the pool this many threads, waiting for the current job first.
+   * Keeps the threads if there already are that many.
+   */
+  void resize(size_t count) {
+    if (count == threads.size()) return;
+    shutdown();
+    std::lock_guard<std::mutex> lk(lock);
+    for (size_t t = 0; t < count; t++) {
+      threads.push_back(std::thread(&ThreadPool::loop, this, t, generation));
+    }
+  }
+
+  /**
+   * Start a job on every thread, waiting for the previous job first.
+   * Returns without waiting for the new one.
+   */
+  void run(std::function<void(size_t)> f) {
+    wait();
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      job = f;
+      running = threads.size();
+      generation++;
+    }
+    wake.notify_all();
+  }
+
+  /**
+   * Run f(part) for every part below parts, on the calling thread and on
+   * whichever threads of the pool have no job to run, and return once all
+   * have. Unlike run, this may be called from inside a job.
+   */
+  void for_each(size_t parts, const std::function<void(size_t)>& f) {
+    std::lock_guard<std::mutex> serial(taskLock);
+    std::unique_lock<std::mutex> lk(lock);
+    task = &f;
+    taskParts = parts;
+    taskNext = 0;
+    taskDone = 0;
+    wake.notify_all();
+    run_parts(lk);
+    taskFinished.wait(lk, [&] { return taskDone == taskParts; });
+    task = NULL;
+    taskParts = taskNext = taskDone = 0;
+  }
+
+  /**
+   * Block until every thread has finished the current job.
+   */
+  void wait() {
+    std::unique_lock<std::mutex> lk(lock);
+    finished.wait(lk, [&] { return running == 0; });
+  }
+};
+
+#endif  // __THREAD_POOL_H__
@@ -0,0 +1,214 @@
+#include "tiled_exr.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "util/image.h"
+#include "util/lodepng.h"
+
+namespace CGL {
+
+namespace {
+
+/**
+ * Appends little-endian values and attributes to a header.
+ */
+struct HeaderBuilder {
+  std::vector<unsigned char> bytes;
+
+  void u8(uint8_t v) { bytes.push_back(v); }
+  void u32(uint32_t v) { for (int i = 0; i < 4; i++) u8((v >> (8 * i)) & 0xff); }
+  void i32(int32_t v) { u32((uint32_t) v); }
+  void f32(float v) { uint32_t x; memcpy(&x, &v, sizeof(x)); u32(x); }
+  void str(const char* s) { bytes.insert(bytes.end(), s, s + strlen(s) + 1); }
+
+  void attribute(const char* name, const char* type, uint32_t size) {
+    str(name);
+    str(type);
+    u32(size);
+  }
+};
+
+void put_u32(unsigned char* out, uint32_t v) {
+  for (int i = 0; i < 4; i++) out[i] = (v >> (8 * i)) & 0xff;
+}
+
+}  // namespace
+
+TiledExrWriter::TiledExrWriter() : file(NULL), failed(false) {}
+
+TiledExrWriter::~TiledExrWriter() {
+  if (file) close();
+}
+
+bool TiledExrWriter::open(const std::string& filename, size_t width, size_t height,
+                          size_t tile_size, const std::vector<Channel>& channels) {
+  file = fopen(filename.c_str(), "wb");
+  if (!file) return false;
+  w = width;
+  h = height;
+  this->channels = channels;
+  fileOrder.resize(channels.size());
+  for (size_t c = 0; c < channels.size(); c++) fileOrder[c] = c;
+  std::sort(fileOrder.begin(), fileOrder.end(), [&](size_t a, size_t b) {
+    return channels[a].name < channels[b].name;
+  });
+  tileSize = tile_size;
+  tilesX = (w + tileSize - 1) / tileSize;
+  tilesY = (h + tileSize - 1) / tileSize;
+  offsets.assign(tilesX * tilesY, 0);
+  pending.clear();
+  tileRowsWritten = 0;
+  failed = false;
+
+  HeaderBuilder header;
+  header.u8(0x76); header.u8(0x2f); header.u8(0x31); header.u8(0x01);
+  header.u32(2 | 0x200);   // version 2, single-part tiled
+
+  // Channels are listed alphabetically, each sampled at every pixel.
+  uint32_t chlist_size = 1;
+  for (const Channel& channel : channels) chlist_size += channel.name.size() + 1 + 16;
+  header.attribute("channels", "chlist", chlist_size);
+  for (size_t c : fileOrder) {
+    header.str(channels[c].name.c_str());
+    header.i32(channels[c].half ? 1 : 2);   // HALF or FLOAT
+    header.u32(0);         // pLinear and reserved
+    header.i32(1);
+    header.i32(1);
+  }
+  header.u8(0);
+
+  header.attribute("compression", "compression", 1);
+  header.u8(3);            // ZIP
+  header.attribute("dataWindow", "box2i", 16);
+  header.i32(0); header.i32(0); header.i32(w - 1); header.i32(h - 1);
+  header.attribute("displayWindow", "box2i", 16);
+  header.i32(0); header.i32(0); header.i32(w - 1); header.i32(h - 1);
+  header.attribute("lineOrder", "lineOrder", 1);
+  header.u8(2);            // RANDOM_Y
+  header.attribute("pixelAspectRatio", "float", 4);
+  header.f32(1);
+  header.attribute("screenWindowCenter", "v2f", 8);
+  header.f32(0); header.f32(0);
+  header.attribute("screenWindowWidth", "float", 4);
+  header.f32(1);
+  header.attribute("tiles", "tiledesc", 9);
+  header.u32(tileSize); header.u32(tileSize);
+  header.u8(0);            // ONE_LEVEL, rounding down
+  header.u8(0);
+
+  tableOffset = header.bytes.size();
+  std::vector<unsigned char> table(offsets.size() * 8, 0);
+  end = tableOffset + table.size();
+  if (fwrite(header.bytes.data(), 1, header.bytes.size(), file) != header.bytes.size() ||
+      fwrite(table.data(), 1, table.size(), file) != table.size()) {
+    failed = true;
+  }
+  return !failed;
+}
+
+bool TiledExrWriter::add_rows(size_t y0, size_t rows, const float* values) {
+  std::lock_guard<std::mutex> lk(lock);
+  if (!file) return false;
+
+  size_t stride = w * channels.size();
+  for (size_t y = y0; y < y0 + rows; y++) {
+    size_t tile_y = y / tileSize;
+    TileRow& row = pending[tile_y];
+    if (row.values.empty()) {
+      row.values.resize(stride * std::min(tileSize, h - tile_y * tileSize));
+      row.rowsFilled = 0;
+    }
+    const float* in = values + (y - y0) * stride;
+    std::copy(in, in + stride, &row.values[(y - tile_y * tileSize) * stride]);
+    row.rowsFilled++;
+
+    if (row.rowsFilled * stride == row.values.size()) {
+      if (!write_tile_row(tile_y, row.values)) failed = true;
+      pending.erase(tile_y);
+    }
+  }
+  return !failed;
+}
+
+bool TiledExrWriter::write_tile_row(size_t tile_y, const std::vector<float>& values) {
+  size_t num_channels = channels.size();
+  size_t rows = values.size() / (w * num_channels);
+  size_t pixel_bytes = 0;
+  for (const Channel& channel : channels) pixel_bytes += channel.half ? 2 : 4;
+
+  std::vector<unsigned char> raw, shuffled, compressed;
+  for (size_t tile_x = 0; tile_x < tilesX; tile_x++) {
+    size_t x0 = tile_x * tileSize;
+    size_t cols = std::min(tileSize, w - x0);
+
+    // Each line of the tile holds the values of one channel after another,
+    // in the file's order of channels.
+    raw.resize(rows * cols * pixel_bytes);
+    unsigned char* out = raw.data();
+    for (size_t y = 0; y < rows; y++) {
+      for (size_t c : fileOrder) {
+        const float* in = &values[(y * w + x0) * num_channels + c];
+        for (size_t x = 0; x < cols; x++) {
+          if (channels[c].half) {
+            uint16_t half = float_to_half(in[num_channels * x]);
+            *out++ = half & 0xff;
+            *out++ = half >> 8;
+          } else {
+            uint32_t bits;
+            memcpy(&bits, &in[num_channels * x], sizeof(bits));
+            for (int b = 0; b < 4; b++) *out++ = (bits >> (8 * b)) & 0xff;
+          }
+        }
+      }
+    }
+
+    // ZIP compression first splits the even and odd bytes into two halves
+    // and replaces each byte by its difference to the one before it.
+    size_t n = raw.size();
+    shuffled.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      shuffled[(i & 1) ? (n + 1) / 2 + i / 2 : i / 2] = raw[i];
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+      shuffled[i] = (unsigned char) (shuffled[i] - shuffled[i - 1] + 128);
+    }
+    compressed.clear();
+    bool zipped = !lodepng::compress(compressed, shuffled.data(), n) && compressed.size() < n;
+    const std::vector<unsigned char>& data = zipped ? compressed : raw;
+
+    unsigned char chunk[20];
+    put_u32(chunk, tile_x);
+    put_u32(chunk + 4, tile_y);
+    put_u32(chunk + 8, 0);
+    put_u32(chunk + 12, 0);
+    put_u32(chunk + 16, data.size());
+    offsets[tile_y * tilesX + tile_x] = end;
+    if (fwrite(chunk, 1, sizeof(chunk), file) != sizeof(chunk) ||
+        fwrite(data.data(), 1, data.size(), file) != data.size()) {
+      return false;
+    }
+    end += sizeof(chunk) + data.size();
+  }
+  tileRowsWritten++;
+  return true;
+}
+
+bool TiledExrWriter::close() {
+  std::lock_guard<std::mutex> lk(lock);
+  if (!file) return false;
+
+  bool ok = !failed && tileRowsWritten == tilesY;
+  std::vector<unsigned char> table(offsets.size() * 8);
+  for (size_t i = 0; i < offsets.size(); i++) {
+    for (int b = 0; b < 8; b++) table[8 * i + b] = (offsets[i] >> (8 * b)) & 0xff;
+  }
+  ok = fseek(file, tableOffset, SEEK_SET) == 0 &&
+       fwrite(table.data(), 1, table.size(), file) == table.size() && ok;
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  pending.clear();
+  return ok;
+}
+
+}  // namespace CGL
@@ -0,0 +1,93 @@
+#ifndef CGL_TILED_EXR_H
+#define CGL_TILED_EXR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace CGL {
+
+/**
+ * Writes a multi-channel image to a tiled OpenEXR file as its rows come in,
+ * so the whole image never has to be in memory.
+ *
+ * Rows can arrive in any order and from any thread. A row of tiles is
+ * held until all its rows have arrived, then compressed, written and
+ * released. The file stores half or full floats, ZIP-compressed per tile,
+ * in whatever order the tiles were completed, so it declares random line
+ * order; close() then fills in the offset table.
+ */
+class TiledExrWriter {
+ public:
+
+  /**
+   * A channel of the file, named as in OpenEXR: "R", "G" and "B" for the
+   * image itself, "layer.X" for channel X of another layer.
+   */
+  struct Channel {
+    std::string name;
+    bool half;        ///< store as half rather than full floats
+  };
+
+  TiledExrWriter();
+
+  /**
+   * Closes the file if still open.
+   */
+  ~TiledExrWriter();
+
+  /**
+   * Create the file and write its header and a placeholder offset table.
+   * \param tile_size side of the square tiles
+   * \param channels channels of each pixel, in the order add_rows() gets
+   *        them (default: half float R, G and B)
+   */
+  bool open(const std::string& filename, size_t width, size_t height, size_t tile_size,
+            const std::vector<Channel>& channels = {{"R", true}, {"G", true}, {"B", true}});
+
+  /**
+   * Add rows [y0, y0 + rows) of the image, counted top-down as in the file,
+   * as a float for each channel of each pixel. Writes the tile rows they
+   * complete.
+   */
+  bool add_rows(size_t y0, size_t rows, const float* values);
+
+  /**
+   * Write the offset table and close the file. Fails if a row is missing
+   * or a write failed.
+   */
+  bool close();
+
+ private:
+
+  /**
+   * Rows of one row of tiles collected so far.
+   */
+  struct TileRow {
+    std::vector<float> values;
+    size_t rowsFilled;
+  };
+
+  bool write_tile_row(size_t tile_y, const std::vector<float>& values);
+
+  FILE* file;
+  size_t w, h;
+  std::vector<Channel> channels;   ///< channels in the order add_rows() gets them
+  std::vector<size_t> fileOrder;   ///< indices into channels, sorted by name as the file stores them
+  size_t tileSize;
+  size_t tilesX, tilesY;
+  uint64_t tableOffset;            ///< file position of the offset table
+  uint64_t end;                    ///< file position past the last tile written
+  std::vector<uint64_t> offsets;   ///< file position of each tile, rows of tiles top-down
+  std::map<size_t, TileRow> pending;  ///< incomplete rows of tiles, by index
+  size_t tileRowsWritten;
+  bool failed;
+  std::mutex lock;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_TILED_EXR_H
@@ -1,52 +1,97 @@
 #ifndef __WORK_QUEUE_H__
 #define __WORK_QUEUE_H__
 
-#include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
 
 /**
- * Note that this queue has no wait-until-more-work-is-added capability; it's
- * intended for more isolated or batch-processing-like situations.
+ * Work shared between a fixed set of threads without a lock. Every thread
+ * has a ring of its own that only it adds to; it takes work from the front
+ * of its own ring first, then from the front of the others' (work
+ * stealing). Taking from the front means items put back go behind
+ * everything already queued, so repeated passes over the same items stay
+ * in order.
+ *
+ * Items are ints, typically indices into an array of the actual work, so
+ * that slots can be read atomically while another thread writes them. Each
+ * ring holds up to the capacity given to reset(), which has to cover every
+ * item queued at once; like before, there is no
+ * wait-until-more-work-is-added capability.
  */
-template <class T>
 class WorkQueue {
  private:
-  std::vector<T> storage;
-  std::mutex lock;
+  struct Ring {
+    std::atomic<size_t> head;    ///< next item to take, advanced by any thread
+    std::atomic<size_t> tail;    ///< next free slot, advanced by the owner
+    std::unique_ptr<std::atomic<int>[]> items;
+  };
+
+  std::vector<std::unique_ptr<Ring>> rings;
+  size_t mask;
+
+  bool take(Ring& ring, int* outPtr) {
+    size_t head = ring.head.load();
+    while (head < ring.tail.load()) {
+      int item = ring.items[head & mask].load();
+      if (ring.head.compare_exchange_weak(head, head + 1)) {
+        *outPtr = item;
+        return true;
+      }
+    }
+    return false;
+  }
 
  public:
 
-  WorkQueue() {}
+  WorkQueue() : mask(0) {}
 
-  bool is_empty() {
-    lock.lock();
-    bool result = storage.empty();
-    lock.unlock();
-    return result;
+  /**
+   * Empty the queue and size it for the given number of threads and items.
+   * Not safe while other threads use the queue.
+   */
+  void reset(size_t threads, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    mask = size - 1;
+
+    rings.clear();
+    for (size_t t = 0; t < threads; t++) {
+      Ring* ring = new Ring();
+      ring->head = 0;
+      ring->tail = 0;
+      ring->items.reset(new std::atomic<int>[size]);
+      rings.push_back(std::unique_ptr<Ring>(ring));
+    }
   }
 
-  bool try_get_work(T *outPtr) {
-    lock.lock();
-    if (storage.empty()) {
-      lock.unlock();
-      return false;
+  bool is_empty() {
+    for (auto& ring : rings) {
+      if (ring->head.load() < ring->tail.load()) return false;
     }
-    *outPtr = storage.front();
-    storage.erase(storage.begin());
-    lock.unlock();
     return true;
   }
 
-  void put_work(const T& item) {
-    lock.lock();
-    storage.push_back(item);
-    lock.unlock();
+  /**
+   * Take an item, from the calling thread's own ring if it has any.
+   */
+  bool try_get_work(size_t thread, int* outPtr) {
+    size_t n = rings.size();
+    for (size_t i = 0; i < n; i++) {
+      if (take(*rings[(thread + i) % n], outPtr)) return true;
+    }
+    return false;
   }
 
-  void clear() {
-    lock.lock();
-    storage.clear();
-    lock.unlock();
+  /**
+   * Queue an item on a thread's ring. Only that thread may call this once
+   * the queue is shared.
+   */
+  void put_work(size_t thread, int item) {
+    Ring& ring = *rings[thread];
+    size_t tail = ring.tail.load();
+    ring.items[tail & mask].store(item);
+    ring.tail.store(tail + 1);
   }
 };
 
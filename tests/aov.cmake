@@ -0,0 +1,46 @@
+# Renders a scene reproducibly with and without every AOV pass, and checks
+# that the passes leave the image alone and land in an EXR next to the png
+# with all their channels, and that the sample counts are the ones asked for.
+#
+# cmake -DPATHTRACER=<binary> -DEXR_CHANNEL=<binary> -DSCENE=<scene.dae> -DOUTPUT_DIR=<dir> -P aov.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/checksum.cmake)
+
+# Without adaptive sampling every pixel takes exactly spp samples.
+set(spp 8)
+foreach(mode plain aov)
+  if(mode STREQUAL "aov")
+    set(passes --aov all)
+  else()
+    set(passes)
+  endif()
+  render_checksum(checksum_${mode} ${mode}
+    -t 2 -s ${spp} -a ${spp} 0 -l 1 -m 3 -r 96 72
+    --seed 5 ${passes} -f ${OUTPUT_DIR}/aov_${mode}.png)
+endforeach()
+
+if(NOT checksum_plain STREQUAL checksum_aov)
+  message(FATAL_ERROR "Checksums differ: ${checksum_plain} without AOVs, ${checksum_aov} with")
+endif()
+if(NOT EXISTS ${OUTPUT_DIR}/aov_aov.exr)
+  message(FATAL_ERROR "Render with AOVs wrote no EXR")
+endif()
+
+# Layer channels are the "layer.X" strings of the header's channel list.
+file(STRINGS ${OUTPUT_DIR}/aov_aov.exr strings LIMIT_INPUT 1024 REGEX "^[a-z]+\\.[A-Za-z]+$")
+foreach(channel depth.Z normal.X albedo.R id.primitive id.material samples.count)
+  list(FIND strings ${channel} found)
+  if(found EQUAL -1)
+    message(FATAL_ERROR "EXR has no ${channel} channel")
+  endif()
+endforeach()
+
+execute_process(
+  COMMAND ${EXR_CHANNEL} ${OUTPUT_DIR}/aov_aov.exr samples.count
+  OUTPUT_VARIABLE range
+  ERROR_VARIABLE range
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT range STREQUAL "${spp} ${spp}\n")
+  message(FATAL_ERROR "samples.count should be ${spp} everywhere, its range is: ${range}")
+endif()
+message(STATUS "Checksum ${checksum_plain} with and without AOVs, EXR has every pass and ${spp} samples per pixel")
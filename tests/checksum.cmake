@@ -0,0 +1,21 @@
+# Included by the test scripts. render_checksum(<var> <what> <args>...) runs
+# the path tracer on SCENE with the arguments, and sets <var> to the image
+# checksum it reports. A failed render or a missing checksum fails the test,
+# naming the render by <what>.
+
+function(render_checksum var what)
+  execute_process(
+    COMMAND ${PATHTRACER} ${ARGN} ${SCENE}
+    OUTPUT_VARIABLE log
+    ERROR_VARIABLE log
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Render ${what} failed:\n${log}")
+  endif()
+
+  string(REGEX MATCH "Image checksum: ([0-9a-f]+)" match "${log}")
+  if(NOT match)
+    message(FATAL_ERROR "Render ${what} reported no checksum:\n${log}")
+  endif()
+  set(${var} ${CMAKE_MATCH_1} PARENT_SCOPE)
+endfunction()
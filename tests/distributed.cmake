@@ -0,0 +1,17 @@
+# Renders a scene reproducibly in this process and spread over worker
+# processes, and checks that the two images have the same checksum.
+#
+# cmake -DPATHTRACER=<binary> -DSCENE=<scene.dae> -DOUTPUT_DIR=<dir> -P distributed.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/checksum.cmake)
+
+foreach(workers 0 3)
+  render_checksum(checksum_${workers} "on ${workers} worker processes"
+    -t 2 -s 16 -a 4 0.05 -l 1 -m 3 -r 160 120
+    --seed 7 --workers ${workers} -f ${OUTPUT_DIR}/distributed_w${workers}.png)
+endforeach()
+
+if(NOT checksum_0 STREQUAL checksum_3)
+  message(FATAL_ERROR "Checksums differ: ${checksum_0} in process, ${checksum_3} on 3 worker processes")
+endif()
+message(STATUS "Checksum ${checksum_0} in process and on 3 worker processes")
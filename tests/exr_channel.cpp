@@ -0,0 +1,157 @@
+// Prints the smallest and largest value of one channel of a tiled EXR as
+// TiledExrWriter writes them, for the test scripts to check a pass against.
+//
+// exr_channel <file.exr> <channel>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "util/image.h"
+#include "util/lodepng.h"
+
+using namespace CGL;
+
+namespace {
+
+uint32_t get_u32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+struct Channel {
+  std::string name;
+  bool half;
+};
+
+int fail(const char* filename, const char* message) {
+  fprintf(stderr, "%s: %s\n", filename, message);
+  return 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <file.exr> <channel>\n", argv[0]);
+    return 2;
+  }
+  const char* filename = argv[1];
+  std::string wanted = argv[2];
+
+  std::ifstream in(filename, std::ios::binary);
+  std::vector<unsigned char> file((std::istreambuf_iterator<char>(in)),
+                                  std::istreambuf_iterator<char>());
+  file.push_back(0);   // ends a truncated header's last string
+  if (file.size() < 9 || get_u32(&file[0]) != 20000630) return fail(filename, "not an EXR");
+
+  // Attributes are a name, a type, a size and the value, up to an empty name.
+  std::vector<Channel> channels;
+  size_t w = 0, h = 0, tile_size = 0;
+  size_t pos = 8;
+  while (pos < file.size() && file[pos] != 0) {
+    std::string name((const char*) &file[pos]);
+    pos += name.size() + 1;
+    std::string type((const char*) &file[pos]);
+    pos += type.size() + 1;
+    if (pos + 4 > file.size()) return fail(filename, "truncated header");
+    size_t size = get_u32(&file[pos]);
+    pos += 4;
+    if (pos + size > file.size()) return fail(filename, "truncated header");
+    const unsigned char* value = &file[pos];
+    if (name == "channels") {
+      for (size_t p = 0; p < size && value[p] != 0;) {
+        Channel channel;
+        channel.name = (const char*) &value[p];
+        p += channel.name.size() + 1;
+        channel.half = get_u32(&value[p]) == 1;
+        p += 16;
+        channels.push_back(channel);
+      }
+    } else if (name == "dataWindow") {
+      w = get_u32(value + 8) + 1;
+      h = get_u32(value + 12) + 1;
+    } else if (name == "tiles") {
+      tile_size = get_u32(value);
+    }
+    pos += size;
+  }
+  pos++;
+  if (w == 0 || h == 0 || tile_size == 0) return fail(filename, "not a tiled EXR");
+
+  size_t pixel_bytes = 0;
+  for (const Channel& channel : channels) pixel_bytes += channel.half ? 2 : 4;
+  size_t tiles_x = (w + tile_size - 1) / tile_size;
+  size_t tiles_y = (h + tile_size - 1) / tile_size;
+  if (pos + tiles_x * tiles_y * 8 > file.size()) return fail(filename, "truncated offset table");
+
+  float lo = std::numeric_limits<float>::infinity();
+  float hi = -lo;
+  bool found = false;
+  std::vector<unsigned char> shuffled, raw;
+  for (size_t tile = 0; tile < tiles_x * tiles_y; tile++) {
+    size_t offset = get_u32(&file[pos + 8 * tile]) |
+                    (size_t) get_u32(&file[pos + 8 * tile + 4]) << 32;
+    if (offset + 20 > file.size()) return fail(filename, "truncated tile");
+    size_t x0 = get_u32(&file[offset]) * tile_size;
+    size_t y0 = get_u32(&file[offset + 4]) * tile_size;
+    size_t size = get_u32(&file[offset + 16]);
+    const unsigned char* data = &file[offset + 20];
+    if (x0 >= w || y0 >= h || offset + 20 + size > file.size()) {
+      return fail(filename, "bad tile");
+    }
+    size_t cols = std::min(tile_size, w - x0);
+    size_t rows = std::min(tile_size, h - y0);
+    size_t n = rows * cols * pixel_bytes;
+
+    // Tiles that did not get smaller are stored as they are. ZIP tiles undo
+    // the byte differences, then interleave the two halves again.
+    if (size < n) {
+      shuffled.clear();
+      if (lodepng::decompress(shuffled, data, size) || shuffled.size() != n) {
+        return fail(filename, "bad ZIP tile");
+      }
+      for (size_t i = 1; i < n; i++) {
+        shuffled[i] = (unsigned char) (shuffled[i - 1] + shuffled[i] - 128);
+      }
+      raw.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        raw[i] = shuffled[(i & 1) ? (n + 1) / 2 + i / 2 : i / 2];
+      }
+    } else if (size == n) {
+      raw.assign(data, data + n);
+    } else {
+      return fail(filename, "bad tile size");
+    }
+
+    const unsigned char* p = raw.data();
+    for (size_t y = 0; y < rows; y++) {
+      for (const Channel& channel : channels) {
+        for (size_t x = 0; x < cols; x++) {
+          float v;
+          if (channel.half) {
+            v = half_to_float(p[0] | (p[1] << 8));
+            p += 2;
+          } else {
+            uint32_t bits = get_u32(p);
+            memcpy(&v, &bits, sizeof(v));
+            p += 4;
+          }
+          if (channel.name == wanted) {
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+            found = true;
+          }
+        }
+      }
+    }
+  }
+  if (!found) return fail(filename, ("no channel " + wanted).c_str());
+
+  printf("%g %g\n", lo, hi);
+  return 0;
+}
@@ -0,0 +1,17 @@
+# Renders a scene reproducibly on one thread and on several, and checks that
+# the two images have the same checksum.
+#
+# cmake -DPATHTRACER=<binary> -DSCENE=<scene.dae> -DOUTPUT_DIR=<dir> -P reproducible.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/checksum.cmake)
+
+foreach(threads 1 8)
+  render_checksum(checksum_${threads} "on ${threads} threads"
+    -t ${threads} -s 16 -a 4 0.05 -l 1 -m 3 -r 64 48
+    --seed 7 -f ${OUTPUT_DIR}/reproducible_t${threads}.png)
+endforeach()
+
+if(NOT checksum_1 STREQUAL checksum_8)
+  message(FATAL_ERROR "Checksums differ: ${checksum_1} on 1 thread, ${checksum_8} on 8 threads")
+endif()
+message(STATUS "Checksum ${checksum_1} on 1 and 8 threads")